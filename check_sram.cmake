@@ -0,0 +1,66 @@
+# Elliott 900 Paper Tape Station emulator for Raspberry Pi Pico
+
+# Copyright (c) Andrew Herbert - 26/06/2021
+
+# MIT Licence.
+
+# Build time check that core1's transfer path runs from SRAM.  Run
+# after linking as
+#
+#   cmake -DELF=picopts.elf -DNM=arm-none-eabi-nm -P check_sram.cmake
+#
+# and fails the build if any of the functions below has been linked
+# into flash (those inlined everywhere have no symbol to check), or
+# if anything in SRAM calls a function in flash other than the few
+# core1 is allowed to call between flash_enter and flash_exit.  The
+# linker marks each call from SRAM to flash with a veneer,
+# __<function>_veneer, placed in SRAM.
+
+cmake_minimum_required(VERSION 3.13)
+
+set(HOT
+  pts_emulation put_pts_ch get_pts_ch wait_for_request idle_irq idle_wait
+  request_edges wait_for_no_request request_resync restart_sm sm_set_enabled
+  ack_width hist_add stage_reader pace_irq pace_put trace_add replay_next
+  bench_random bench_next bench_run cal_step cal_settle cal_finish
+  cal_apply cal_reack reader_dma_queue reader_dma_unchain reader_dma_irq
+  reader_stream_poll reader_stream_next reader_dma_done ring_count ring_free
+  ring_get ring_peek ring_skip
+  ring_write ring_put ring_read log_event flash_enter flash_exit stall_set
+  postmortem_add core1_fail)
+
+set(FLASH_CALLS set_up_core1 set_reader_program reader_stream_start
+  reader_stream_stop)
+
+if (NOT ELF OR NOT NM)
+  message(FATAL_ERROR "check_sram: ELF and NM must be set")
+endif()
+
+execute_process(COMMAND ${NM} ${ELF}
+  OUTPUT_VARIABLE symbols RESULT_VARIABLE status)
+if (NOT status EQUAL 0)
+  message(FATAL_ERROR "check_sram: ${NM} ${ELF} failed")
+endif()
+
+string(REPLACE "\n" ";" symbols "${symbols}")
+set(errors 0)
+foreach(line IN LISTS symbols)
+  if (line MATCHES "^([0-9a-fA-F]+) [tTwW] (.+)$")
+    set(address ${CMAKE_MATCH_1})
+    set(name ${CMAKE_MATCH_2})
+    if (address MATCHES "^1" AND name IN_LIST HOT)
+      message(SEND_ERROR "check_sram: ${name} is in flash (${address})")
+      math(EXPR errors "${errors} + 1")
+    endif()
+    if (address MATCHES "^2" AND name MATCHES "^__(.+)_veneer$")
+      if (NOT CMAKE_MATCH_1 IN_LIST FLASH_CALLS)
+        message(SEND_ERROR "check_sram: SRAM calls ${CMAKE_MATCH_1} in flash")
+        math(EXPR errors "${errors} + 1")
+      endif()
+    endif()
+  endif()
+endforeach()
+
+if (errors GREATER 0)
+  message(FATAL_ERROR "check_sram: ${ELF} fails")
+endif()
@@ -0,0 +1,888 @@
+// Elliott 900 Paper Tape Station emulator for Raspberry Pi Pico
+
+// Copyright (c) Andrew Herbert - 26/06/2021
+
+// MIT Licence.
+
+// Host tool for PicoPTS using the bulk USB interfaces (see
+// usb_descriptors.c) rather than the serial console.
+//
+//   ptstool store FILE NAME [-r] [-b BLANKS | -m MARKER]
+//                               store tape in the library
+//   ptstool send FILE [-r]      read tape straight away
+//   ptstool mount N [-B]        mount library tape, -B to boot it
+//   ptstool unmount [-B]        stop reading it, -B no longer boot
+//   ptstool seek BLOCK          reposition the mounted tape
+//   ptstool list                list the library
+//   ptstool erase               empty the library
+//   ptstool punched             list captured punch tapes
+//   ptstool get N FILE          fetch captured punch tape N
+//   ptstool punch FILE [SECS]   save punch output until idle SECS
+//   ptstool stats               characters moved and ring levels
+//   ptstool trace record|replay|stop
+//                               record transfers, replay reader
+//   ptstool trace get FILE      fetch the transfers recorded
+//   ptstool errors [POLICY ...] handshake error policy, halt, retry,
+//                               skip or resync, for reader, punch
+//                               and teleprinter, or one for all
+//   ptstool calibrate [MARGIN | defaults | show]
+//                               calibrate from the transfers made
+//                               next, MARGIN percent (default 50)
+//                               added, or forget the calibration
+//   ptstool bench WORKLOAD PATTERN N [SEED [GAP]]
+//                               run N transfers of a benchmark,
+//                               workload reader, punch, alternate,
+//                               random or ttysel, pattern count,
+//                               prng, blank or ones, GAP uS between
+//                               requests on picopts_loopback
+//   ptstool bench stop          end the benchmark running
+//   ptstool loop PATTERN N [SEED [GAP]]
+//                               on picopts_loopback, send N characters
+//                               of a benchmark pattern to be read and
+//                               punched back by normal service, then
+//                               check the tape captured
+//
+// Tapes are run length coded before sending unless -r is given.
+// Tape is sent as frames of up to FRAME_DATA bytes, gathered into
+// XFER_SIZE byte transfers with XFERS of them in flight at once so
+// the station always has more to hand while the USB host is busy.
+// Tape to be read straight away goes FRAME_CHARS characters to a
+// frame and only as far as the station's credit allows, asking for
+// more (H_CREDIT) once less than CREDIT_LOW is left, so the reader
+// ring stays full but no frame is ever left waiting for room in
+// it.  If the 920M stops reading the tool waits, asking again every
+// CREDIT_WAIT_MS.  Otherwise the station simply stops taking
+// transfers until it is ready, with nothing lost.  Stored tapes are
+// checked by comparing the station's CRC-32 of the characters with
+// the tool's.  Fetched punch tapes are checked against the length
+// promised and their CRC-32 is printed.  A benchmark is polled
+// every BENCH_POLL_MS until its results are ready.  While fetching
+// punch output the tool asks for it on the punch interface with
+// H_LISTEN, renewed every LISTEN_RENEW_S, so the station goes back
+// to the serial port by itself if the tool goes away.  A loopback
+// run sends its tape as for send, waits for the station to report
+// the characters read, then waits up to LOOP_WAIT_S for the tape
+// punched back to be captured and compares it with the one sent.
+//
+// Build with
+//   cc -O2 -o ptstool ptstool.c $(pkg-config --cflags --libs libusb-1.0)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+#define USB_VID     0x2E8A
+#define USB_PID     0x000A
+#define ITF_LINK    2    // vendor interfaces, as usb_descriptors.c
+#define ITF_PUNCH   3
+#define EP_LINK_OUT 0x03
+#define EP_LINK_IN  0x83
+#define EP_PUNCH_IN 0x84
+
+#define XFERS       8    // transfers in flight
+#define XFER_SIZE   4096 // bytes in each
+#define FRAME_DATA  4096 // most payload in a tape frame
+#define REPLY_MS    10000 // wait this long for a reply
+#define FRAME_CHARS 1024 // characters in a frame for reading
+#define CREDIT_LOW  8192 // ask for more credit when less than this
+#define CREDIT_WAIT_MS 10 // between asking while reader stopped
+#define BENCH_POLL_MS 500 // between asking for benchmark results
+#define LISTEN_RENEW_S  1 // between renewals of H_LISTEN, well within
+                          // the station's PUNCH_LEASE_US
+#define LOOP_WAIT_S    30 // for a loopback run to be read and captured
+#define LINE_MAX    256
+
+// Frames, as picopts.c
+#define HOST_SYNC   0245
+#define H_TAPE      'T'
+#define H_TAPE_RLE  'R'
+#define H_STORE     'S'
+#define H_DATA      'D'
+#define H_END       'E'
+#define H_MOUNT     'M'
+#define H_UNMOUNT   'U'
+#define H_SEEK      'B'
+#define H_LIST      'L'
+#define H_ERASE     'X'
+#define H_PUNCHED   'P'
+#define H_GET       'G'
+#define H_STATS     'Q'
+#define H_CREDIT    'F'
+#define H_TRACE     'V'
+#define TRACE_STOP   0
+#define TRACE_RECORD 1
+#define TRACE_REPLAY 2
+#define TRACE_GET    3
+#define H_BENCH     'N'
+#define H_ERRORS    'H'
+#define H_CALIBRATE 'A'
+#define H_LISTEN    'O'
+#define H_LOOP      'W'
+#define CAL_MARGIN   50
+#define CAL_DEFAULTS 255
+#define TAPE_RLE    2
+#define TAPE_MARKER 4
+
+// Run length coding, as picopts.c
+#define RLE_RUN         0200
+#define RLE_RUN_MIN     3
+#define RLE_RUN_MAX     (127 + RLE_RUN_MIN)
+#define RLE_LITERAL_MAX 128
+
+typedef struct
+{
+  struct libusb_transfer *t;
+  uint8_t buf[XFER_SIZE];
+  int busy;
+} xfer_t;
+
+static libusb_context *ctx;
+static libusb_device_handle *dev;
+static xfer_t xfers[XFERS];
+static int xfer_fill = 0;       // transfer being filled
+static uint32_t xfer_len = 0;   // and bytes in it
+static int in_flight = 0;
+static int xfer_failed = 0;
+static uint8_t in_buf[512];     // replies from the station
+static int in_len = 0, in_pos = 0;
+
+
+static void fail(const char *s)
+{
+  fprintf(stderr, "ptstool: %s\n", s);
+  exit(1);
+}
+
+static void usage()
+{
+  fail("usage: store FILE NAME [-r] [-b BLANKS | -m MARKER], send FILE [-r],"
+       " mount N [-B], unmount [-B], seek BLOCK, list, erase, punched,"
+       " get N FILE, punch FILE [SECS], stats,"
+       " trace record|replay|stop|get FILE,"
+       " errors [POLICY ...], calibrate [MARGIN|defaults|show],"
+       " bench WORKLOAD PATTERN N [SEED [GAP]], bench stop,"
+       " loop PATTERN N [SEED [GAP]]");
+}
+
+
+/**********************************************************/
+/*                           USB                          */
+/**********************************************************/
+
+
+static void usb_open()
+{
+  if ( libusb_init(&ctx) ) fail("cannot start libusb");
+  if ( !(dev = libusb_open_device_with_vid_pid(ctx, USB_VID, USB_PID)) )
+    fail("no PicoPTS found");
+  if ( libusb_claim_interface(dev, ITF_LINK)
+       || libusb_claim_interface(dev, ITF_PUNCH) )
+    fail("cannot claim PicoPTS interfaces");
+  for ( int i = 0 ; i < XFERS ; i++ )
+    if ( !(xfers[i].t = libusb_alloc_transfer(0)) ) fail("out of memory");
+}
+
+static void usb_close()
+{
+  libusb_release_interface(dev, ITF_LINK);
+  libusb_release_interface(dev, ITF_PUNCH);
+  libusb_close(dev);
+  libusb_exit(ctx);
+}
+
+static void LIBUSB_CALL sent(struct libusb_transfer *t)
+{
+  xfer_t *x = t->user_data;
+  if ( t->status != LIBUSB_TRANSFER_COMPLETED
+       || t->actual_length != t->length )
+    xfer_failed = 1;
+  x->busy = 0;
+  in_flight--;
+}
+
+/* Submit the transfer being filled, then wait for the next one to */
+/* be free to fill                                                 */
+
+static void link_submit()
+{
+  xfer_t *x = &xfers[xfer_fill];
+  if ( xfer_len == 0 ) return;
+  libusb_fill_bulk_transfer(x->t, dev, EP_LINK_OUT, x->buf, xfer_len,
+			    sent, x, 0); // no timeout, station may wait
+  x->busy = 1;
+  in_flight++;
+  if ( libusb_submit_transfer(x->t) ) fail("cannot submit USB transfer");
+  xfer_fill = (xfer_fill + 1) % XFERS;
+  xfer_len = 0;
+  while ( xfers[xfer_fill].busy ) libusb_handle_events(ctx);
+  if ( xfer_failed ) fail("USB transfer failed");
+}
+
+static void link_send(const uint8_t *s, uint32_t n)
+{
+  while ( n )
+    {
+      uint32_t m = XFER_SIZE - xfer_len;
+      if ( m > n ) m = n;
+      memcpy(&xfers[xfer_fill].buf[xfer_len], s, m);
+      xfer_len += m;
+      s += m;
+      n -= m;
+      if ( xfer_len == XFER_SIZE ) link_submit();
+    }
+}
+
+/* Wait for everything sent to be taken */
+
+static void link_drain()
+{
+  link_submit();
+  while ( in_flight ) libusb_handle_events(ctx);
+  if ( xfer_failed ) fail("USB transfer failed");
+}
+
+static void frame(uint32_t type, const uint8_t *s, uint32_t n)
+{
+  uint8_t h[4] = { HOST_SYNC, type, n & 255, n >> 8 };
+  link_send(h, sizeof(h));
+  link_send(s, n);
+}
+
+/* Next byte from the station, -1 if none within ms */
+
+static int link_getc(unsigned ms)
+{
+  if ( in_pos == in_len )
+    {
+      int got = 0, r;
+      r = libusb_bulk_transfer(dev, EP_LINK_IN, in_buf, sizeof(in_buf),
+			       &got, ms);
+      if ( (r && r != LIBUSB_ERROR_TIMEOUT) || got == 0 ) return -1;
+      in_len = got;
+      in_pos = 0;
+    }
+  return in_buf[in_pos++];
+}
+
+/* Gather a reply line, returning 1 with it in line, without the */
+/* line end, once complete or 0 if nothing comes within ms        */
+
+static int reply_line(char *line, unsigned ms)
+{
+  static char part[LINE_MAX];
+  static int n = 0;
+  int ch;
+  while ( (ch = link_getc(ms)) >= 0 )
+    if ( ch == '\n' )
+      {
+	part[n] = 0;
+	strcpy(line, part);
+	n = 0;
+	return 1;
+      }
+    else if ( ch != '\r' && n < LINE_MAX - 1 )
+      part[n++] = ch;
+  return 0;
+}
+
+/* Read reply lines, printing any before the one starting "OK" or  */
+/* "ERROR", which is returned                                      */
+
+static char *reply(char *line)
+{
+  while ( 1 )
+    {
+      if ( !reply_line(line, REPLY_MS) ) fail("no reply from PicoPTS");
+      if ( strncmp(line, "OK", 2) == 0 || strncmp(line, "ERROR", 5) == 0 )
+	return line;
+      puts(line);
+    }
+}
+
+/* Send a frame and wait for its reply, fail unless OK */
+
+static char *command(uint32_t type, const uint8_t *s, uint32_t n, char *line)
+{
+  frame(type, s, n);
+  link_drain();
+  if ( strncmp(reply(line), "OK", 2) != 0 ) fail(line);
+  return line;
+}
+
+
+/**********************************************************/
+/*                   RUN LENGTH CODING                    */
+/**********************************************************/
+
+
+typedef struct
+{
+  uint8_t  literal[RLE_LITERAL_MAX];
+  uint32_t literal_count;
+  uint32_t run_ch;
+  uint32_t run_count;
+} rle_coder_t;
+
+static uint32_t rle_flush_literal(rle_coder_t *c, uint8_t *out)
+{
+  uint32_t n = c->literal_count;
+  if ( n == 0 ) return 0;
+  out[0] = n - 1;
+  memcpy(out + 1, c->literal, n);
+  c->literal_count = 0;
+  return n + 1;
+}
+
+static uint32_t rle_flush_run(rle_coder_t *c, uint8_t *out)
+{
+  uint32_t n = 0;
+  if ( c->run_count >= RLE_RUN_MIN )
+    {
+      n = rle_flush_literal(c, out);
+      out[n++] = RLE_RUN | (c->run_count - RLE_RUN_MIN);
+      out[n++] = c->run_ch;
+    }
+  else
+    for ( uint32_t i = 0 ; i < c->run_count ; i++ )
+      {
+	if ( c->literal_count == RLE_LITERAL_MAX )
+	  n += rle_flush_literal(c, out + n);
+	c->literal[c->literal_count++] = c->run_ch;
+      }
+  c->run_count = 0;
+  return n;
+}
+
+/* Code a whole tape, out must have room for n + n/128 + 2 bytes */
+
+static uint32_t rle_code(const uint8_t *s, uint32_t n, uint8_t *out)
+{
+  rle_coder_t c = { .literal_count = 0, .run_count = 0 };
+  uint32_t m = 0;
+  for ( uint32_t i = 0 ; i < n ; i++ )
+    {
+      if ( c.run_count && s[i] == c.run_ch && c.run_count < RLE_RUN_MAX )
+	{
+	  c.run_count++;
+	  continue;
+	}
+      m += rle_flush_run(&c, out + m);
+      c.run_ch = s[i];
+      c.run_count = 1;
+    }
+  m += rle_flush_run(&c, out + m);
+  return m + rle_flush_literal(&c, out + m);
+}
+
+/* Decode a whole coded tape into out, or just count the characters */
+/* if out is NULL.  Returns the count or -1 if malformed.           */
+
+static long rle_decode(const uint8_t *s, uint32_t n, uint8_t *out)
+{
+  long length = 0;
+  uint32_t i = 0;
+  while ( i < n )
+    {
+      uint32_t r = s[i++];
+      if ( r & RLE_RUN )
+	{
+	  if ( i == n ) return -1;
+	  if ( out ) memset(out + length, s[i], (r & 127) + RLE_RUN_MIN);
+	  length += (r & 127) + RLE_RUN_MIN;
+	  i++;
+	}
+      else
+	{
+	  if ( i + r + 1 > n ) return -1;
+	  if ( out ) memcpy(out + length, &s[i], r + 1);
+	  length += r + 1;
+	  i += r + 1;
+	}
+    }
+  return length;
+}
+
+static uint32_t crc32(const uint8_t *s, uint32_t n)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  while ( n-- )
+    {
+      crc ^= *s++;
+      for ( int i = 0 ; i < 8 ; i++ )
+	crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  return ~crc;
+}
+
+
+/**********************************************************/
+/*                        COMMANDS                        */
+/**********************************************************/
+
+
+static uint8_t *read_file(const char *name, uint32_t *n)
+{
+  FILE *f = fopen(name, "rb");
+  uint8_t *s;
+  long size;
+  if ( !f || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 )
+    fail("cannot read tape file");
+  rewind(f);
+  if ( !(s = malloc(size + 1)) || fread(s, 1, size, f) != (size_t) size )
+    fail("cannot read tape file");
+  fclose(f);
+  *n = size;
+  return s;
+}
+
+/* Tape as sent, coded unless raw */
+
+static uint8_t *tape_bytes(const uint8_t *tape, uint32_t n, int raw,
+			   uint32_t *size)
+{
+  uint8_t *s;
+  if ( raw )
+    {
+      *size = n;
+      return (uint8_t *) tape;
+    }
+  if ( !(s = malloc(n + n / RLE_LITERAL_MAX + 2)) ) fail("out of memory");
+  *size = rle_code(tape, n, s);
+  return s;
+}
+
+static void send_frames(uint32_t type, const uint8_t *s, uint32_t n)
+{
+  for ( uint32_t i = 0 ; i < n ; i += FRAME_DATA )
+    frame(type, s + i, n - i < FRAME_DATA ? n - i : FRAME_DATA);
+  link_drain();
+}
+
+static void store(int argc, char **argv)
+{
+  uint8_t cmd[6 + 11], *tape, *s;
+  uint32_t n, size, flags = 0, mark = 0, got_length, got_crc;
+  char line[LINE_MAX];
+  int raw = 0;
+  if ( argc < 4 ) usage();
+  for ( int i = 4 ; i < argc ; i++ )
+    if ( strcmp(argv[i], "-r") == 0 )
+      raw = 1;
+    else if ( strcmp(argv[i], "-b") == 0 && i + 1 < argc )
+      mark = strtoul(argv[++i], NULL, 0);
+    else if ( strcmp(argv[i], "-m") == 0 && i + 1 < argc )
+      {
+	mark = strtoul(argv[++i], NULL, 0);
+	flags |= TAPE_MARKER;
+      }
+    else
+      usage();
+  tape = read_file(argv[2], &n);
+  s = tape_bytes(tape, n, raw, &size);
+  if ( !raw ) flags |= TAPE_RLE;
+  cmd[0] = size; cmd[1] = size >> 8; cmd[2] = size >> 16; cmd[3] = size >> 24;
+  cmd[4] = flags;
+  cmd[5] = mark;
+  strncpy((char *) &cmd[6], argv[3], sizeof(cmd) - 6);
+  command(H_STORE, cmd, 6 + strnlen(argv[3], sizeof(cmd) - 6), line);
+  send_frames(H_DATA, s, size);
+  command(H_END, NULL, 0, line);
+  if ( sscanf(line, "OK %*u length %u crc %x", &got_length, &got_crc) != 2
+       || got_length != n || got_crc != crc32(tape, n) )
+    fail("tape stored does not match file");
+  printf("%s, %u bytes sent\n", line, size);
+}
+
+static void nap(unsigned ms)
+{
+  struct timespec t = { ms / 1000, (ms % 1000) * 1000000L };
+  nanosleep(&t, NULL);
+}
+
+/* Send n characters of tape to be read straight away, within the */
+/* station's credit, returning the bytes sent                      */
+
+static uint32_t send_tape(const uint8_t *tape, uint32_t n, int raw)
+{
+  uint8_t *s;
+  uint32_t size, total = 0, granted, sent;
+  char line[LINE_MAX];
+  int asked = 0;
+  command(H_CREDIT, NULL, 0, line);
+  if ( sscanf(line, "OK credit %u taken %u", &granted, &sent) != 2 )
+    fail(line);
+  for ( uint32_t i = 0 ; i < n ; )
+    {
+      uint32_t m = n - i < FRAME_CHARS ? n - i : FRAME_CHARS;
+      int32_t left = granted - sent; // less than none if ring taken
+      int stalled = left < (int32_t) m; // by a library tape meanwhile
+      if ( !asked && left < CREDIT_LOW )
+	{
+	  if ( stalled ) nap(CREDIT_WAIT_MS); // reader not taking tape
+	  frame(H_CREDIT, NULL, 0);
+	  link_submit();
+	  asked = 1;
+	}
+      if ( asked && reply_line(line, stalled ? REPLY_MS : 1) )
+	{
+	  if ( sscanf(line, "OK credit %u", &granted) != 1 ) fail(line);
+	  asked = 0;
+	}
+      else if ( stalled )
+	fail("no reply from PicoPTS");
+      if ( (int32_t) (granted - sent) < (int32_t) m ) continue;
+      s = tape_bytes(tape + i, m, raw, &size);
+      frame(raw ? H_TAPE : H_TAPE_RLE, s, size);
+      if ( s != tape + i ) free(s);
+      total += size;
+      sent += m;
+      i += m;
+    }
+  link_drain();
+  if ( asked ) reply(line); // last credit
+  return total;
+}
+
+static void send(int argc, char **argv)
+{
+  uint8_t *tape;
+  uint32_t n, total;
+  int raw = argc > 3 && strcmp(argv[3], "-r") == 0;
+  if ( argc < 3 ) usage();
+  tape = read_file(argv[2], &n);
+  total = send_tape(tape, n, raw);
+  printf("OK %u characters, %u bytes sent\n", n, total);
+}
+
+/* Fetch captured punch tape, setting its length */
+
+static uint8_t *get_tape(uint32_t tape, long *length)
+{
+  uint8_t cmd[4], *s, *t;
+  uint32_t n;
+  char line[LINE_MAX];
+  cmd[0] = tape; cmd[1] = tape >> 8; cmd[2] = tape >> 16; cmd[3] = tape >> 24;
+  command(H_GET, cmd, sizeof(cmd), line);
+  if ( sscanf(line, "OK %u", &n) != 1 || !(s = malloc(n + 1)) )
+    fail(line);
+  for ( uint32_t i = 0 ; i < n ; i++ )
+    {
+      int ch = link_getc(REPLY_MS);
+      if ( ch < 0 ) fail("punch tape cut short");
+      s[i] = ch;
+    }
+  if ( (*length = rle_decode(s, n, NULL)) < 0 ) fail("punch tape garbled");
+  if ( !(t = malloc(*length + 1)) ) fail("out of memory");
+  rle_decode(s, n, t);
+  free(s);
+  return t;
+}
+
+static void get(int argc, char **argv)
+{
+  uint8_t *t;
+  long length;
+  FILE *f;
+  if ( argc < 4 ) usage();
+  t = get_tape(strtoul(argv[2], NULL, 0), &length);
+  if ( !(f = fopen(argv[3], "wb")) || fwrite(t, 1, length, f) != (size_t) length
+       || fclose(f) )
+    fail("cannot write tape file");
+  printf("OK %ld characters crc %08x\n", length, crc32(t, length));
+}
+
+static void punch(int argc, char **argv)
+{
+  uint8_t buf[XFER_SIZE];
+  char line[LINE_MAX];
+  uint8_t on = 1, off = 0;
+  uint32_t total = 0, idle = argc > 3 ? strtoul(argv[3], NULL, 0) : 10;
+  time_t last = time(NULL), renewed = 0;
+  FILE *f;
+  if ( argc < 3 ) usage();
+  if ( !(f = fopen(argv[2], "wb")) ) fail("cannot write tape file");
+  while ( !total || time(NULL) - last < idle )
+    {
+      int got = 0, r;
+      if ( time(NULL) - renewed >= LISTEN_RENEW_S )
+	{
+	  command(H_LISTEN, &on, 1, line); // punch comes this way
+	  renewed = time(NULL);
+	}
+      r = libusb_bulk_transfer(dev, EP_PUNCH_IN, buf, sizeof(buf),
+			       &got, 1000);
+      if ( r && r != LIBUSB_ERROR_TIMEOUT ) fail("USB transfer failed");
+      if ( got == 0 ) continue;
+      fwrite(buf, 1, got, f);
+      fflush(f);
+      total += got;
+      last = time(NULL);
+    }
+  command(H_LISTEN, &off, 1, line); // back to the serial port
+  fclose(f);
+  printf("OK %u characters\n", total);
+}
+
+/* Each entry as recorded: time seen (4 bytes lsb first), character, */
+/* device, request to ACK then ACK to clear (uS)                     */
+
+static void trace(int argc, char **argv)
+{
+  static const char *modes[] = { "stop", "record", "replay" };
+  char line[LINE_MAX];
+  uint8_t mode = TRACE_GET;
+  uint32_t n;
+  FILE *f;
+  if ( argc < 3 ) usage();
+  for ( int i = 0 ; i < 3 ; i++ )
+    if ( strcmp(argv[2], modes[i]) == 0 ) mode = i;
+  if ( mode != TRACE_GET )
+    {
+      puts(command(H_TRACE, &mode, 1, line));
+      return;
+    }
+  if ( strcmp(argv[2], "get") != 0 || argc < 4 ) usage();
+  command(H_TRACE, &mode, 1, line);
+  if ( sscanf(line, "OK %u", &n) != 1 ) fail(line);
+  if ( !(f = fopen(argv[3], "wb")) ) fail("cannot write trace file");
+  for ( uint32_t i = 0 ; i < 8 * n ; i++ )
+    {
+      int ch = link_getc(REPLY_MS);
+      if ( ch < 0 ) fail("trace cut short");
+      putc(ch, f);
+    }
+  if ( fclose(f) ) fail("cannot write trace file");
+  printf("OK %u transfers\n", n);
+}
+
+/* Set the error policies, if given, and print them and the counts */
+
+static void errors(int argc, char **argv)
+{
+  static const char *policies[] = { "halt", "retry", "skip", "resync" };
+  char line[LINE_MAX];
+  uint8_t cmd[3];
+  int n = argc - 2;
+  if ( n > 3 ) usage();
+  for ( int i = 0 ; i < n ; i++ )
+    {
+      int p = -1;
+      for ( int j = 0 ; j < 4 ; j++ )
+	if ( strcmp(argv[2 + i], policies[j]) == 0 ) p = j;
+      if ( p < 0 ) usage();
+      cmd[i] = p;
+    }
+  puts(command(H_ERRORS, cmd, n, line));
+}
+
+/* Start a benchmark, then wait for it to finish and print results */
+
+static void bench(int argc, char **argv)
+{
+  static const char *workloads[] =
+    { "reader", "punch", "alternate", "random", "ttysel" };
+  static const char *patterns[] = { "count", "prng", "blank", "ones" };
+  char line[LINE_MAX];
+  uint8_t cmd[14];
+  uint32_t n, seed, gap;
+  int w = -1, p = -1;
+  if ( argc == 3 && strcmp(argv[2], "stop") == 0 )
+    {
+      cmd[0] = 255; // BENCH_STOP, results go to whoever started it
+      puts(command(H_BENCH, cmd, 1, line));
+      return;
+    }
+  if ( argc < 5 ) usage();
+  for ( int i = 0 ; i < 5 ; i++ )
+    if ( strcmp(argv[2], workloads[i]) == 0 ) w = i;
+  for ( int i = 0 ; i < 4 ; i++ )
+    if ( strcmp(argv[3], patterns[i]) == 0 ) p = i;
+  if ( w < 0 || p < 0 ) usage();
+  n = strtoul(argv[4], NULL, 0);
+  seed = argc > 5 ? strtoul(argv[5], NULL, 0) : 1;
+  gap = argc > 6 ? strtoul(argv[6], NULL, 0) : 0;
+  cmd[0] = w;
+  cmd[1] = p;
+  for ( int i = 0 ; i < 4 ; i++ )
+    {
+      cmd[2 + i] = n >> 8 * i;
+      cmd[6 + i] = seed >> 8 * i;
+      cmd[10 + i] = gap >> 8 * i;
+    }
+  puts(command(H_BENCH, cmd, sizeof(cmd), line));
+  do
+    {
+      nap(BENCH_POLL_MS);
+      frame(H_BENCH, NULL, 0);
+      link_drain();
+    }
+  while ( strcmp(reply(line), "ERROR benchmark running") == 0 );
+  if ( strncmp(line, "OK", 2) != 0 ) fail(line);
+  puts(line);
+}
+
+/* Number of the last punch tape captured in full, -1 if none, */
+/* setting its length                                           */
+
+static long last_punched(uint32_t *length)
+{
+  char line[LINE_MAX], rest[LINE_MAX];
+  unsigned tape, n;
+  long last = -1;
+  frame(H_PUNCHED, NULL, 0);
+  link_drain();
+  while ( 1 )
+    {
+      if ( !reply_line(line, REPLY_MS) ) fail("no reply from PicoPTS");
+      if ( strcmp(line, "OK") == 0 ) return last;
+      if ( strncmp(line, "ERROR", 5) == 0 ) fail(line);
+      if ( sscanf(line, "PUNCHED %u %u%s", &tape, &n, rest) == 2 )
+	{
+	  last = tape; // oldest first, partial tapes skipped
+	  *length = n;
+	}
+    }
+}
+
+/* Send a tape following a benchmark pattern to be read on the  */
+/* loopback build, with each character punched back, and check */
+/* what was read and the tape captured.                        */
+
+static void loop(int argc, char **argv)
+{
+  static const char *patterns[] = { "count", "prng", "blank", "ones" };
+  char line[LINE_MAX];
+  uint8_t cmd[13], *tape, *got;
+  uint32_t n, seed, gap, x, length, read, punched, errors;
+  long before, after, got_length;
+  time_t start;
+  int p = -1;
+  if ( argc < 4 ) usage();
+  for ( int i = 0 ; i < 4 ; i++ )
+    if ( strcmp(argv[2], patterns[i]) == 0 ) p = i;
+  if ( p < 0 ) usage();
+  n = strtoul(argv[3], NULL, 0);
+  seed = argc > 4 ? strtoul(argv[4], NULL, 0) : 1;
+  gap = argc > 5 ? strtoul(argv[5], NULL, 0) : 0;
+  if ( seed == 0 ) seed = 1; // as the station
+  if ( !(tape = malloc(n + 1)) ) fail("out of memory");
+  x = seed;
+  for ( uint32_t i = 0 ; i < n ; i++ ) // the reads of bench_next's
+    switch ( p )                       // alternate workload
+      {
+      case 0: tape[i] = 2 * i; break;
+      case 1:
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	tape[i] = x >> 24;
+	break;
+      case 2: tape[i] = 0; break;
+      default: tape[i] = 255;
+      }
+  before = last_punched(&length);
+  cmd[0] = p;
+  for ( int i = 0 ; i < 4 ; i++ )
+    {
+      cmd[1 + i] = n >> 8 * i;
+      cmd[5 + i] = seed >> 8 * i;
+      cmd[9 + i] = gap >> 8 * i;
+    }
+  puts(command(H_LOOP, cmd, sizeof(cmd), line));
+  send_tape(tape, n, 0);
+  start = time(NULL);
+  do
+    {
+      if ( time(NULL) - start > LOOP_WAIT_S ) fail("tape not all read");
+      nap(BENCH_POLL_MS);
+      frame(H_LOOP, NULL, 0);
+      link_drain();
+    }
+  while ( strcmp(reply(line), "ERROR loopback running") == 0 );
+  if ( sscanf(line, "OK pattern=%*s length=%*u seed=%*u read=%u punched=%u"
+	      " errors=%u", &read, &punched, &errors) != 3 )
+    fail(line);
+  puts(line);
+  if ( read != n || punched != n || errors ) fail("tape read wrongly");
+  while ( (after = last_punched(&length)) == before )
+    {
+      if ( time(NULL) - start > LOOP_WAIT_S ) fail("tape not captured");
+      nap(BENCH_POLL_MS);
+    }
+  got = get_tape(after, &got_length);
+  if ( got_length != n || memcmp(got, tape, n) != 0 )
+    fail("tape captured does not match tape sent");
+  printf("OK %u characters read and punched back\n", n);
+}
+
+int main(int argc, char **argv)
+{
+  char line[LINE_MAX];
+  uint8_t cmd[2];
+  int boot = argc > 2 && strcmp(argv[argc - 1], "-B") == 0;
+  if ( argc < 2 ) usage();
+  usb_open();
+  if ( strcmp(argv[1], "store") == 0 )
+    store(argc, argv);
+  else if ( strcmp(argv[1], "send") == 0 )
+    send(argc, argv);
+  else if ( strcmp(argv[1], "get") == 0 )
+    get(argc, argv);
+  else if ( strcmp(argv[1], "punch") == 0 )
+    punch(argc, argv);
+  else if ( strcmp(argv[1], "trace") == 0 )
+    trace(argc, argv);
+  else if ( strcmp(argv[1], "bench") == 0 )
+    bench(argc, argv);
+  else if ( strcmp(argv[1], "loop") == 0 )
+    loop(argc, argv);
+  else if ( strcmp(argv[1], "errors") == 0 )
+    errors(argc, argv);
+  else if ( strcmp(argv[1], "calibrate") == 0 )
+    {
+      int show = argc > 2 && strcmp(argv[2], "show") == 0;
+      unsigned long margin = argc < 3 ? CAL_MARGIN
+	: strcmp(argv[2], "defaults") == 0 ? CAL_DEFAULTS
+	: strtoul(argv[2], NULL, 0);
+      if ( margin > CAL_DEFAULTS ) usage();
+      cmd[0] = margin;
+      puts(command(H_CALIBRATE, cmd, show ? 0 : 1, line));
+    }
+  else
+    {
+      if ( strcmp(argv[1], "mount") == 0 && argc > 2 )
+	{
+	  cmd[0] = strtoul(argv[2], NULL, 0);
+	  cmd[1] = boot;
+	  command(H_MOUNT, cmd, 2, line);
+	}
+      else if ( strcmp(argv[1], "unmount") == 0 )
+	{
+	  cmd[0] = boot;
+	  command(H_UNMOUNT, cmd, 1, line);
+	}
+      else if ( strcmp(argv[1], "seek") == 0 && argc > 2 )
+	{
+	  uint32_t block = strtoul(argv[2], NULL, 0);
+	  cmd[0] = block;
+	  cmd[1] = block >> 8;
+	  command(H_SEEK, cmd, 2, line);
+	}
+      else if ( strcmp(argv[1], "list") == 0 )
+	command(H_LIST, NULL, 0, line);
+      else if ( strcmp(argv[1], "erase") == 0 )
+	command(H_ERASE, NULL, 0, line);
+      else if ( strcmp(argv[1], "punched") == 0 )
+	command(H_PUNCHED, NULL, 0, line);
+      else if ( strcmp(argv[1], "stats") == 0 )
+	command(H_STATS, NULL, 0, line);
+      else
+	usage();
+      puts(line);
+    }
+  usb_close();
+  return 0;
+}
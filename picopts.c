@@ -38,6 +38,263 @@
 // ACK_PIN, used as described above to signal completion of a
 // data transfer to/from the paper tape station.
 //
+// Which GPIO is which depends on the board profile, PTS_BOARD,
+// chosen when building (see CMakeLists.txt): the wiring listed
+// below, or a custom one read from a header of its own, named by
+// PTS_BOARD_HEADER, defining the same pins.  The masks and shifts
+// used to move characters are worked out from it at compile time,
+// and the build fails if the reader or punch data pins are not
+// consecutive or a pin is used twice.
+//
+// The RDRREQ/PUNREQ/ACK handshakes are carried out by two PIO
+// state machines (see picopts.pio) so that the turnaround is
+// deterministic.  Characters are exchanged with core1 through the
+// PIO FIFOs.  Whenever the next reader character is already
+// buffered it is staged on the RDR pins as soon as the previous
+// request clears, so that a tape read only has to be ACKed.
+// Alternatively a tape mounted from the library is streamed to the
+// reader by DMA straight from flash with no per character work by
+// core1, which is then only interrupted every DMA_BLOCK characters.
+// A teleprinter read holds the stream: its state machine waits
+// with the read raised, core1 stops the DMA where the tape had got
+// to and loads the staged reader, which serves the read from the
+// keyboard as usual, and the stream carries on from the same place
+// once the read has cleared.
+//
+// Reader tapes can be sent from the host over the USB serial
+// connection.  core0 reads them from USB in batches into a ring
+// buffer in SRAM from which core1 takes characters as the computer
+// requests them.  Punched characters travel the other way through a
+// second ring buffer and are sent to the host in batches.
+//
+// The USB device (see usb_descriptors.c) has a CDC serial port for
+// the console and logging and two vendor class bulk interfaces for
+// tape, so binary tape never shares a stream with log text.  Frames
+// can arrive on either the serial port or the link interface and
+// replies go back the way the frame came.  Punch output is sent on
+// the punch interface, in full packets, rather than the serial port
+// only while the host has asked for it with H_LISTEN, which lapses
+// unless renewed within PUNCH_LEASE_US, and is dropped if the
+// interface goes away (unplugged or bus reset) or takes nothing for
+// USB_WRITE_US.  Should the serial port stop taking punch output
+// too it is still captured, and what the host missed is counted in
+// H_STATS, so the punch is never held up by a host that has stopped
+// listening.  There is no background USB task: core0 calls
+// tud_task() from its loop and while waiting.
+//
+// A host streaming tape asks for credit with H_CREDIT and is told
+// how many characters of tape, counted from the start, it may have
+// sent: those already put in the reader ring plus the room left.
+// Keeping within that, and asking again before it runs out, the
+// host can keep the ring full without ever having a frame stuck
+// half read, so commands behind tape are obeyed promptly.
+//
+// Transfers are routed by TTYSEL.  Teleprinter output goes through
+// a small ring of its own and is sent to the host as soon as core0
+// sees it, rather than waiting for a packet's worth like the punch,
+// and keyboard input, anything the host sends outside a frame, comes
+// through another, so typing is never queued behind tape.  Keyboard
+// input arriving when its ring is full is lost, as it would be on a
+// real teleprinter.
+//
+// core0 translates between the teleprinter's code and ASCII as it
+// moves console characters, by table, so a plain terminal can be
+// used.  The code is CONSOLE_CODE at start up and may be changed by
+// H_CONSOLE: 5 hole 900 telecode, where the printer and keyboard
+// each keep their own letter or figure shift and shifts are sent
+// as needed, 8 hole ISO code with even parity, or no translation.
+// Return is typed as CR LF and the pound sign is sent as UTF-8.
+//
+// Input from the host is in frames: HOST_SYNC, a type, a 16 bit
+// length (lsb first) and that many bytes of payload.  H_TAPE frames
+// carry reader tape.  The others manage a tape library held in the
+// flash after the program (see LIBRARY_OFFSET), a directory sector
+// followed by each tape stored contiguously.  A mounted tape is
+// streamed to the reader by DMA straight from the XIP mapping, so
+// it is never copied into SRAM, and a tape marked for boot is
+// mounted at start up without a host.  Flash cannot be read by the
+// DMA while it is being written, so each write waits until the
+// stream has nothing in flight, the reader's FIFO full or the whole
+// tape transferred, and holds the reader state machine meanwhile,
+// so the 920M waits for its next character at most the time of a
+// sector erase.  Only erasing the library, which would let the tape
+// being streamed be overwritten, is refused while streaming.
+// Replies are lines starting "OK" or "ERROR".
+//
+// Punched characters are also captured in a log in flash after the
+// library (see CAPTURE_OFFSET), so tapes punched with no host
+// attached can be fetched later.  core0 gathers them into one of
+// two sector buffers and writes each in turn to the next sector of
+// the log, which it has already erased, going round all the sectors
+// so that they wear evenly.  A tape ends, and the sector holding its
+// end is written, once the punch has been idle for CAPTURE_IDLE_US
+// after the runout.  core1 is never stopped for this: everything it
+// does while transferring runs from SRAM and it keeps off flash
+// altogether while core0 is writing.  A host being sent the punch
+// output is never kept waiting for the log: what there is no room
+// for is lost from the captured tape, counted in H_STATS and
+// reported when the tape ends.
+//
+// Tapes can be run length coded, as records of 0nnnnnnn followed by
+// n+1 literal characters or 1nnnnnnn c for n+RLE_RUN_MIN copies of
+// c, which makes leader, runout and filler almost free.  The punch
+// capture log is always coded, each sector on its own.  Library
+// tapes and H_TAPE_RLE frames may be.  Coded tapes are decoded by
+// core0 into the reader ring, a bounded amount of work for each
+// character, so core1 and the reader see no difference.
+//
+// As a tape is stored an index of its blocks is built in the sector
+// before the image.  By default a block starts at the first
+// character after a run of at least INDEX_BLANKS blanks (or after
+// the leader), otherwise at each occurrence of a marker character.
+// H_SEEK repositions the mounted tape at the start of a block,
+// discarding whatever was already in the reader ring.
+//
+// core0 keeps a CRC-32, a sum check (the characters added in an 18
+// bit word) and a count of the characters of the tape being read
+// and the tape being punched.  The CRC and the sum are both worked
+// out by the DMA sniffer as a spare DMA channel copies each batch
+// to nowhere, once for the CRC and once more for the sum, so core0
+// does no work per character and only waits for the copies, each
+// about a cycle a character from SRAM.  Reader characters are taken
+// from the reader ring once core1 has used them, just before core0
+// refills their slots, and a tape streamed by DMA is added as a
+// whole once the stream ends (not if it is cut short).  A tape ends
+// when its device has been idle for TAPE_IDLE_US, or for the
+// reader when another tape is mounted, and its sums are printed
+// then and kept for H_STATS.
+//
+// core1 timestamps each transfer with the hardware timer as it sees
+// the request, or as the request edge woke it if it was idle, and
+// as it hands the state machine the character or go ahead, which
+// ACKs a fixed few cycles later; a staged read or primed punch is
+// ACKed by the state machine a few cycles after the request.  How
+// long the request takes to clear after ACK ends is counted by the
+// state machine and comes with its done word.
+// The request to ACK and ACK to clear times are kept as log2
+// histograms for the reader, punch and teleprinter separately and
+// printed by core0 when logging is enabled.  core1 also counts the
+// characters transferred in each direction.  Only core1 writes the
+// counts, which are 32 bits and so read whole by core0, which keeps
+// 64 bit totals and rolling rates over 1, 10 and 60 seconds.
+//
+// H_TRACE starts core1 recording every transfer it makes (so not
+// those by a DMA stream) in a trace in SRAM: when the request was
+// seen, the device, the character and how long the ACK and the
+// clearing of the request took.  The trace can be fetched by the
+// host and replayed: the reader characters in it are given to the
+// computer again, each ACK held back, as when pacing, until the gap
+// from the one before is as long as it was when recorded, so the
+// same workload can be run against different firmware.
+//
+// H_BENCH runs a benchmark in place of normal service: a workload
+// of reads, punches, both alternately, both at random or both to
+// tape and teleprinter at random, with the reader characters (and
+// those expected from the punch) following a pattern.  The order
+// comes from a generator, bench_next, which the computer side must
+// run too with the same seed, and any transfer out of turn or
+// punched character not as expected is counted as an error.  The
+// first request is waited for however long it takes, so the 920M
+// can be started at leisure, but once transfers are under way the
+// run stops early if no request comes for BENCH_STALL_US, and
+// H_BENCH with BENCH_STOP as its payload ends it at any time.  The
+// throughput, the spread of the request to ACK and ACK to clear
+// times as percentiles, the error count, the handshake timeouts,
+// which are counted and do not end the run, and how it ended are
+// then printed as a single line of name=value pairs.
+//
+// The picopts_loopback build (PTS_LOOPBACK) has no need of a 920M:
+// a state machine on pio1 plays the computer, driving the request,
+// TTYSEL and punch pins itself while the station goes on reading
+// them as inputs, so no jumpers are needed, and nothing else should
+// be connected.  core0 feeds it the benchmark workload, running
+// bench_next in step with core1, with a gap between requests given
+// by H_BENCH, and checks the characters it reads.  The rate is
+// limited by how promptly core0 keeps its FIFO filled.  A benchmark
+// is served by core1 alone, so the loopback build also has H_LOOP,
+// where the computer side drives normal service instead: it reads
+// the tape the host streams, which must follow one of the benchmark
+// patterns, and punches each character straight back, so the reader
+// ring, credit, punch ring, USB and capture all carry it.  core0
+// checks the characters read against the pattern and the host
+// checks the tape captured against the one it sent.  H_LOOP with no
+// payload reports how the last run went.
+//
+// H_CALIBRATE finds the 920M's own timing from the transfers it is
+// making, so some tape must be read or punched meanwhile.  core1
+// first measures how long the computer takes to drop a request once
+// ACK ends, over CAL_TRANSFERS transfers, then shortens ACK by
+// CAL_STEP_NS every CAL_TRANSFERS transfers until a request is not
+// dropped in good time, when ACK is pulsed again at the last width
+// that worked.  That width and the longest release time, each plus
+// a margin, become the ACK width and the handshake timeout, and are
+// kept in the flash sector after the capture log (CONFIG_OFFSET)
+// for use from then on.  The FIFO is polled continuously while a
+// request clears, so there is no poll interval to tune.  A tape
+// mounted while calibrating goes through the reader ring rather
+// than by DMA, as when pacing, so that core1 sees every transfer,
+// and as when pacing no reader character is staged and the punch
+// is not primed, so that no ACK is given before its request.
+//
+// A request that has not cleared in time after its ACK is a
+// handshake error.  What is done about it is set for each device by
+// H_ERRORS: wait again a few times, give up on the transfer (and
+// throw away the state machine's word when the request does clear),
+// wait for the request to drop however long it takes and start the
+// state machine again from idle, or as formerly halt.  To halt,
+// core1 leaves the fail code for core0 and stops, and core0 powers
+// the 920M off and flashes the code on the LED.  Each is counted,
+// and reported by H_ERRORS, and the benchmark counts the timeouts
+// during its run.
+//
+// Everything core1 does per transfer, and the interrupts it takes,
+// runs from SRAM, so a flash cache miss caused by core0 can never
+// hold up a handshake.  The variables it uses for each transfer
+// are kept in scratch X (CORE1_DATA), the SRAM bank that only core1
+// and its stack use, and its few calls into flash, all made at start
+// up or between flash_enter and flash_exit, are to functions kept
+// out of line so that the build can check (see check_sram.cmake)
+// that no other call from SRAM goes to flash.  Division, which the
+// transfer path uses to work out the ACK width, goes to the divider
+// routines, built into SRAM too.
+//
+// The hardware watchdog resets the station if core0 stops feeding
+// it, which it does from its loop, and as it sends to USB or
+// sleeps so that a long reply (a captured tape, say) cannot starve
+// it, only while core1 is making progress.  core1 marks itself busy
+// from seeing a request to seeing it clear, but not while it waits
+// for tape, a paced ACK or a request to drop before resyncing,
+// which may take as long as they like, and a handshake still going
+// STALL_US after it is due to end is a stall.  What happened is
+// kept in a post-mortem record in SRAM left alone at start up:
+// core1 adds every transfer to a short trace there and core0
+// copies the counts and histograms into it every second and on a
+// stall.  After a watchdog reset the record is reported when a host
+// connects and the station starts again as at power on, resetting
+// the 920M.  H_ERRORS reports how many watchdog resets there have
+// been since power on.
+//
+// core1 never calls printf.  Instead it records events as fixed
+// size binary records in a lock-free ring which core0 formats and
+// sends to USB in its spare time.  If the ring is full events are
+// dropped and counted rather than holding up the computer.
+//
+// Normally the station answers as fast as the computer asks.  In
+// paced mode (H_PACE) each ACK is held back until the device's
+// character time has passed since its last one, so programs with
+// timing loops see the real reader, punch and teleprinter speeds.
+// Nothing is staged, the punch state machine waits for a go ahead
+// and an alarm on the hardware timer puts the character, or the go
+// ahead, at exactly the right time while core1 sleeps.  Buffering is
+// the same in both modes, except that mounted tapes are fed through
+// the reader ring rather than by DMA while pacing.
+//
+// When there have been no requests for IDLE_SPIN_US core1 stops
+// polling and sleeps with WFE until a rising edge on RDRREQ_PIN or
+// PUNREQ_PIN interrupts it, then polls again.  The time from that
+// interrupt to seeing the request is reported with the histograms.
+// (Dormant mode is not used as core0 needs its clocks for USB.)
+//
 // II_AUTO_PIN, high selects that on a reset / restart the
 // computer should execute an autostart, i.e., jump to location
 // 8177.  If low the computer should obey the initial orders
@@ -51,14 +308,33 @@
 // can continue to execute until next reset by raising NOPOWER
 // high again.
 //
+// At start up NOPOWER is held high for at least RESET_MIN_US and
+// then until the request lines have been low for RESET_QUIET_US,
+// as they are once the 920M has settled, or RESET_MAX_US at most.
+// core0 releases it from its loop, so core1 is already serving
+// requests and USB and logging come up meanwhile, with nothing
+// waiting for a host.  A host connecting later is told the state.
+//
 // An additional GPIO pins are used to set options for the
 // emulation:
 //
 // LOG_PIN, high signals that diagnostic logging messages
-// should be sent to the USB port.This pin only read at the start
-// of an emulation. If it is desired to change the setting the Pico
-// must be restarted either by removing, then replacing the USB power
-// cable, or using the  button provided for this purpose.
+// should be sent to the USB port.  The pin is read at the start
+// of an emulation and logging follows it whenever it changes
+// thereafter.  Logging can also be turned on or off from the
+// operator console.
+//
+// The operator console shares the serial port with the teleprinter
+// keyboard.  Typing OPERATOR_ESCAPE (control-]), unless the code is
+// CODE_RAW, gives a "pts>" prompt and the line typed after it, ended
+// by return, is obeyed as a command instead of going to the computer
+// (type help for a list).  Most commands are the host frames by
+// name, with their payload as numbers or words, so they are obeyed
+// exactly as if the host had sent them, and the others reset the
+// counts, print the histograms, print the trace or set logging.  A
+// command is obeyed by core0 between its other work, as are long
+// listings, a few lines at a time, so the console never holds up
+// core1 or the tapes.
 //
 // The onboard LED (LED_PIN) is used to signal emulation status.
 // Immediately after loaded the LED is flashed 4 times to
@@ -85,14 +361,27 @@
 
 
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/clocks.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "hardware/timer.h"
+#include "hardware/watchdog.h"
 #include "pico/binary_info.h"
 #include "tusb.h"
+#include "pico/stdio/driver.h"
 #include "pico/multicore.h"
 #include <setjmp.h>
 
+#include "picopts.pio.h"
+
 
 /**********************************************************/
 /*                         DEFINES                        */
@@ -102,13 +391,264 @@
 #define TRUE  1
 #define FALSE 0
 
-// Limit on polling loops
+// core1's per transfer variables, in the SRAM bank it has to itself
+#define CORE1_DATA __scratch_x("core1")
+
+// Limit on polling loops (uS), unless calibrated
 #define POLL_LIMIT 2000
 
-// GPIO pins
+// Handshake timing, unless calibrated
+#define ACK_US 4 // width of ACK pulse (uS)
+
+// PIO state machines
+#define PTS_PIO pio0
+#define RDR_SM  0    // reader handshake
+#define PUN_SM  1    // punch handshake
+
+// DMA reader stream
+#define DMA_BLOCK        1024 // characters per DMA transfer
+
+// Tape library in flash, after the program image
+#define LIBRARY_OFFSET 0x80000  // from start of flash, program must end first
+#define LIBRARY_SIZE   0x100000 // directory sector and tape images
+#define LIBRARY_MAGIC  0x45393230 // marks a directory entry in use
+#define LIBRARY_TAPES  (FLASH_SECTOR_SIZE / sizeof(tape_entry_t))
+#define TAPE_NAME_SIZE 12       // including NUL
+#define TAPE_BOOT      1        // flag: mount at start up
+#define TAPE_RLE       2        // flag: run length coded
+#define TAPE_MARKER    4        // flag: blocks start at a marker character
+#define INDEX_BLANKS  64        // default blanks between blocks
+#define INDEX_BLOCKS   ((FLASH_SECTOR_SIZE - 4) / sizeof(index_entry_t))
+#define TAPE_POLL_MAX  256      // most characters decoded per loop
+
+// Run length coding
+#define RLE_RUN        0200     // record is a run
+#define RLE_RUN_MIN       3     // shortest run coded as one
+#define RLE_RUN_MAX    (127 + RLE_RUN_MIN)
+#define RLE_LITERAL_MAX 128     // longest literal span
+#define RLE_SLACK       264     // coded bytes one character can release
+                                // plus those still held by the coder
+#define RLE_LITERAL       1     // decoder states, 0 = expecting a record
+#define RLE_CHAR          2
+#define RLE_RUNNING       3
+
+// Punch capture log in flash, after the tape library
+#define CAPTURE_OFFSET  (LIBRARY_OFFSET + LIBRARY_SIZE)
+#define CAPTURE_SECTORS 127        // sectors in log, used in turn
+#define CAPTURE_MAGIC   0x50554e43 // marks a written log sector
+#define CAPTURE_DATA    (FLASH_SECTOR_SIZE - sizeof(capture_header_t))
+#define CAPTURE_IDLE_US 5000000    // punch idle this long ends a tape (uS)
+#define CAPTURE_END     1          // flag: sector holds end of a tape
+#define FLASH_HOLD_US   200        // longest wait for a stream to be idle
+
+// Calibration, kept in flash after the punch capture log
+#define CONFIG_OFFSET   (CAPTURE_OFFSET + CAPTURE_SECTORS * FLASH_SECTOR_SIZE)
+#define CONFIG_MAGIC    0x43414c31 // marks calibration in use
+#define CAL_TRANSFERS   1000 // transfers measured at each step
+#define CAL_STEP_NS      250 // ACK shortened by this each step (nS)
+#define CAL_MIN_NS       250 // shortest ACK tried (nS)
+#define CAL_MISS_US       20 // plus twice longest release: request missed
+#define CAL_TIMEOUT_MIN  100 // shortest timeout kept (uS)
+#define CAL_DEFAULTS     255 // H_CALIBRATE: forget calibration
+#define CAL_RELEASE        0 // phases: measuring release time
+#define CAL_ACK            1 // shortening ACK
+#define CAL_DONE           2 // waiting to set final values
+
+// Operator console
+#define OPERATOR_ESCAPE 035 // control-], starts a command
+#define OPERATOR_MAX     80 // longest command line
+#define OPERATOR_WORDS    8 // most words in a command
+#define OPERATOR_BATCH    4 // trace lines printed per loop
+#define OP_IDLE           0 // operator_state: keyboard input to computer
+#define OP_TYPING         1 // command being typed
+#define OP_DONE           2 // command obeyed at CR, drop LF after it
+#define OP_HELP           1 // console's own commands, not host frames
+#define OP_RESET          2
+#define OP_HIST           3
+#define OP_DUMP           4
+#define OP_LOG            5
+#define LOG_ALL           2 // OP_LOG: log every transfer as well
+
+// Host link frames: HOST_SYNC, type, length (lsb first), payload
+#define HOST_SYNC    0245 // starts every frame
+#define HOST_CMD_MAX   64 // longest command payload kept
+#define H_TAPE        'T' // reader tape
+#define H_TAPE_RLE    'R' // reader tape, run length coded
+#define H_STORE       'S' // store tape: bytes (4, lsb first), flags,
+                          // blanks between blocks or marker, name
+#define H_DATA        'D' // tape being stored
+#define H_END         'E' // end of tape being stored
+#define H_MOUNT       'M' // mount tape: number, optional boot flag
+#define H_UNMOUNT     'U' // stop reading tape: optional clear boot flag
+#define H_SEEK        'B' // position mounted tape at block (2 bytes)
+#define H_PACE        'C' // pacing: on/off, then optionally cps (2 bytes
+                          // each) for reader, punch and teleprinter
+#define H_CONSOLE     'K' // teleprinter code: CODE_...
+#define H_LIST        'L' // list library
+#define H_ERASE       'X' // empty library
+#define H_PUNCHED     'P' // list captured punch tapes
+#define H_GET         'G' // fetch captured tape: number (4 bytes lsb first)
+#define H_STATS       'Q' // report characters moved and ring levels
+#define H_CREDIT      'F' // report tape characters host may have sent
+#define H_TRACE       'V' // transfer trace: TRACE_...
+#define H_CALIBRATE   'A' // calibrate with margin (percent), or
+                          // CAL_DEFAULTS, or report
+#define H_ERRORS      'H' // handshake error policy: ERR_... for reader,
+                          // punch and teleprinter, or one for all
+#define H_BENCH       'N' // benchmark: workload, pattern, transfers
+                          // (4 bytes), optionally seed and loopback
+                          // gap between requests (uS) (4 bytes each)
+#define H_LOOP        'W' // loopback service: pattern, characters
+                          // (4 bytes), optionally seed and gap (uS)
+                          // (4 bytes each), PTS_LOOPBACK builds only
+#define H_LISTEN      'O' // punch output by bulk USB: on/off, renewed
+                          // within PUNCH_LEASE_US
+
+// Checksums
+#define CRC_INIT 0xFFFFFFFFu // CRC-32 (as zip), inverted at the end
+#define SUM_MASK   0777777   // sum check kept in an 18 bit word
+#define SUM_CHUNK     4096   // most characters summed per loop
+#define TAPE_IDLE_US CAPTURE_IDLE_US // device idle this long ends tape
+#define SNIFF_CRC32R     1   // sniffer mode: CRC-32, bit reversed data
+#define SNIFF_SUM      0xF   // sniffer mode: 32 bit sum
+
+// USB, vendor interfaces numbered as in usb_descriptors.c
+#define USB_LINK      0       // host link frames and replies
+#define USB_PUNCH     1       // punch output
+#define USB_WRITE_US  1000000 // give up if host takes nothing this long
+
+// Reader ring buffer, filled from USB by core0, emptied by core1
+#define READER_RING_SIZE 16384 // must be a power of 2
+#define READER_RING_LOW   4096 // start reading USB when below this
+#define READER_RING_HIGH 15360 // stop reading USB when above this
+
+// Punch ring buffer, filled by core1, emptied to USB by core0
+#define PUNCH_RING_SIZE  16384 // must be a power of 2
+#define PUNCH_PACKET        64 // send to USB when this much waiting
+#define PUNCH_IDLE_US    20000 // or when punch idle this long
+#define PUNCH_LEASE_US 5000000 // H_LISTEN lapses unless renewed
+
+// Teleprinter rings, printer filled by core1, keyboard by core0
+#define PRINTER_RING_SIZE  1024 // must be a power of 2
+#define KEYBOARD_RING_SIZE  256 // must be a power of 2
+
+// Teleprinter codes
+#define CODE_RAW          0 // no translation
+#define CODE_5HOLE        1 // 900 telecode, letter and figure shifts
+#define CODE_8HOLE        2 // ISO 7 bit code with even parity
+#define CONSOLE_CODE CODE_5HOLE // code at start up
+#define TELE_FS          27 // 5 hole figure shift
+#define TELE_CR          29 // carriage return
+#define TELE_LF          30 // line feed
+#define TELE_LS          31 // letter shift
+#define TELE_LETTERS   0x20 // in console_in: needs letter shift
+#define TELE_FIGURES   0x40 // needs figure shift
+#define TELE_SHIFT     0x60
+#define POUND          0xA3 // pound sign in Latin-1
+#define UTF8_POUND     0xC2 // which UTF-8 sends after this
+
+// Handshake errors
+#define ERR_HALT          0 // policies: halt, as after any other failure
+#define ERR_RETRY         1 // wait again, ERR_RETRIES times, then resync
+#define ERR_SKIP          2 // abandon transfer, ignore request clearing
+#define ERR_RESYNC        3 // wait for request to drop, restart machine
+#define ERR_RETRIES       4
+#define ERROR_POLICY ERR_RETRY // policy at start up
+
+// Start up
+#define RESET_MIN_US   100000 // hold NOPOWER high at least this long (uS)
+#define RESET_QUIET_US  20000 // and until requests low this long
+#define RESET_MAX_US  5000000 // but no longer than this
+
+// Watchdog
+#define WATCHDOG_MS         2000 // reset unless fed this often
+#define STALL_US         1000000 // core1 stalled if this late (uS)
+#define POSTMORTEM_MAGIC 0x504d3031 // marks post-mortem record set up
+#define POSTMORTEM_TRACE      32 // transfers kept, must be a power of 2
+#define PM_WATCHDOG            1 // causes: core0 stopped feeding it
+#define PM_STALL               2 // core1 stuck in a handshake
+
+// Idle
+#define IDLE_SPIN_US 100000 // poll this long before sleeping (uS)
+
+// Pacing, rates can be changed by H_PACE
+#define PACE_ALARM        1 // hardware timer alarm used by core1
+#define PACE_MARGIN_US    2 // ACK at once if due sooner than this (uS)
+#define PACE_READER_CPS 250 // characters per second
+#define PACE_PUNCH_CPS  110
+#define PACE_TTY_CPS     10
+
+// Transfer trace
+#define TRACE_ENTRIES 4096 // transfers recorded
+#define TRACE_STOP       0 // H_TRACE modes: stop recording or replaying
+#define TRACE_RECORD     1 // record from empty
+#define TRACE_REPLAY     2 // replay reader characters recorded
+#define TRACE_GET        3 // send trace to host
+
+// Benchmark
+#define BENCH_READER      0 // workloads: reads only
+#define BENCH_PUNCH       1 // punches only
+#define BENCH_ALTERNATE   2 // read, then punch the character read
+#define BENCH_RANDOM      3 // reads and punches in random order
+#define BENCH_TTYSEL      4 // and to tape or teleprinter at random
+#define BENCH_COUNT       0 // patterns: 0, 1, 2 ... 255, 0 ...
+#define BENCH_PRNG        1 // pseudo-random
+#define BENCH_BLANK       2 // all 0
+#define BENCH_ONES        3 // all 255
+#define BENCH_SEED        1 // default seed
+#define BENCH_STALL_US 2000000 // stop if no request this long once
+                               // under way (uS)
+#define BENCH_STOP      255 // H_BENCH payload: end the run now
+#define BENCH_LAT_MAX   256 // latencies counted to the uS below this
+
+// Loopback computer, PTS_LOOPBACK builds only
+#define LOOP_PIO     pio1
+#define LOOP_SM         0
+#define LOOP_EXPECT    16 // reads in flight, must be a power of 2
+
+// Latency histograms
+#define HIST_BUCKETS  16 // bucket n counts times of 2^(n-1) to 2^n-1 uS
+#define HIST_DEVICES   3
+#define HIST_READER    0
+#define HIST_PUNCH     1
+#define HIST_TTY       2
+#define HIST_REQ_ACK   0 // request seen to start of ACK
+#define HIST_ACK_CLEAR 1 // end of ACK to request cleared
+#define HIST_PERIOD   60 // secs between printing histograms
+
+// Throughput counters
+#define DIR_IN         0 // characters to the computer
+#define DIR_OUT        1 // characters from the computer
+#define RATE_HISTORY  61 // secs of totals kept for rolling rates
+
+// Event log
+#define EVENT_RING_SIZE 256 // records, must be a power of 2
+#define EVENT_BATCH       8 // most records core0 formats per loop
+#define EV_TIMEOUT        1 // request did not clear, arg = uS waited
+#define EV_WRONG_REQUEST  2 // unexpected request type, arg = expected
+#define EV_TEST_FAIL      3 // ch = got, arg = expected
+#define EV_STREAM_START   4 // DMA reader stream started, arg = length
+#define EV_STREAM_END     5 // DMA reader stream finished
+#define EV_READER_EMPTY   6 // reader waiting for tape
+#define EV_PUNCH_FULL     7 // punch waiting for room, arg = HIST_...
+#define EV_READ           8 // ch read, only if log_transfers
+#define EV_PUNCH          9 // ch punched, only if log_transfers
+
+// GPIO pins, by board profile.  PTS_BOARD is set by CMakeLists.txt
+// and everything below the profiles is worked out from them at
+// compile time.
+
+#define PTS_BOARD_PICOPTS 1 // as described above
+#define PTS_BOARD_CUSTOM  2 // pins defined by PTS_BOARD_HEADER
+
+#ifndef PTS_BOARD
+#define PTS_BOARD PTS_BOARD_PICOPTS
+#endif
+
+#if PTS_BOARD == PTS_BOARD_PICOPTS
 
 #define RDR_1_PIN    0 // Set lsb of reader output
-#define RDR_2_PIN    1 // these pins are assumed consecutive
+#define RDR_2_PIN    1 // these pins must be consecutive
 #define RDR_4_PIN    2
 #define RDR_8_PIN    3
 #define RDR_16_PIN   4
@@ -116,10 +656,8 @@
 #define RDR_64_PIN   6
 #define RDR_128_PIN  7 // Set msb of reader input
 
-#define RDR_PINS_MASK 0377 // PINs to bit mask 
-
 #define PUN_1_PIN    8 // Set lsb of punch input
-#define PUN_2_PIN    9 // these pins are assumed consecutive 
+#define PUN_2_PIN    9 // these pins must be consecutive
 #define PUN_4_PIN   10
 #define PUN_8_PIN   11
 #define PUN_16_PIN  12
@@ -127,9 +665,6 @@
 #define PUN_64_PIN  14 
 #define PUN_128_PIN 15 // Set msb of punch output
 
-#define PUN_PINS_MASK 0177400 // PINs to bit mask
-
-/* N.B. the following pins are different to those assigned in pico900 */
 #define NOPOWER_PIN 16 // set HIGH to stop and reset, set LOW to run
 #define ACK_PIN     17 // pulse HIGH to acknowledge RDR or PUN request
 #define II_AUTO_PIN 18 // set HIGH to autostart on reset, or LOW to execute
@@ -147,48 +682,539 @@
 // GPIO27 spare
 // GPIO28 spare
 
-#define IN_PINS  11 // count of input pins
-#define OUT_PINS 12 // count of output pins
+#elif PTS_BOARD == PTS_BOARD_CUSTOM
+
+#ifndef PTS_BOARD_HEADER
+#error "PTS_BOARD_CUSTOM: PTS_BOARD_HEADER must name the pin map"
+#endif
+#include PTS_BOARD_HEADER // every _PIN above, for your own board
+
+#else
+#error "PTS_BOARD: no such board profile"
+#endif
+
+// Worked out from the profile.  Each byte is moved with a single
+// shift, by the PIO, so its pins must be consecutive.
+
+#define PINS_CONSECUTIVE(p1, p2, p4, p8, p16, p32, p64, p128) \
+  ((p2) == (p1) + 1 && (p4) == (p1) + 2 && (p8) == (p1) + 3 \
+   && (p16) == (p1) + 4 && (p32) == (p1) + 5 && (p64) == (p1) + 6 \
+   && (p128) == (p1) + 7)
+
+_Static_assert(PINS_CONSECUTIVE(RDR_1_PIN, RDR_2_PIN, RDR_4_PIN, RDR_8_PIN,
+				RDR_16_PIN, RDR_32_PIN, RDR_64_PIN,
+				RDR_128_PIN), "reader pins not consecutive");
+_Static_assert(PINS_CONSECUTIVE(PUN_1_PIN, PUN_2_PIN, PUN_4_PIN, PUN_8_PIN,
+				PUN_16_PIN, PUN_32_PIN, PUN_64_PIN,
+				PUN_128_PIN), "punch pins not consecutive");
+
+#define RDR_PINS_MASK (0xFFu << RDR_1_PIN) // PINs to bit mask
+#define PUN_PINS_MASK (0xFFu << PUN_1_PIN)
+#define RDRREQ_BIT    (1u << RDRREQ_PIN)
+#define PUNREQ_BIT    (1u << PUNREQ_PIN)
+#define TTYSEL_SHIFT  ((TTYSEL_PIN - PUN_1_PIN) & 31) // in punch request word
+
+#define IN_PINS_MASK  (RDRREQ_BIT | PUNREQ_BIT | (1u << TTYSEL_PIN) \
+		       | PUN_PINS_MASK)
+#define OUT_PINS_MASK ((1u << NOPOWER_PIN) | (1u << ACK_PIN) \
+		       | (1u << II_AUTO_PIN) | (1u << LED_PIN) | RDR_PINS_MASK)
+
+_Static_assert(__builtin_popcount(IN_PINS_MASK) == 11
+	       && __builtin_popcount(OUT_PINS_MASK) == 12
+	       && (IN_PINS_MASK & (OUT_PINS_MASK | (1u << LOG_PIN))) == 0
+	       && (OUT_PINS_MASK & (1u << LOG_PIN)) == 0,
+	       "board profile uses a pin twice");
+_Static_assert(((IN_PINS_MASK | OUT_PINS_MASK | (1u << LOG_PIN))
+		& (~0x1FFFFFFFu | (3u << 23))) == 0, // GPIO 0-22, 25-28
+	       "board profile uses a GPIO the Pico does not bring out");
+_Static_assert(((RDRREQ_PIN - TTYSEL_PIN) & 31) < 31
+	       && ((PUNREQ_PIN - PUN_1_PIN) & 31) < 31 && TTYSEL_SHIFT < 31,
+	       "request words are only 31 bits");
+
+#if PTS_LOOPBACK
+_Static_assert(RDRREQ_PIN == PUNREQ_PIN + 1, "loopback side-sets both");
+_Static_assert(TTYSEL_PIN - PUN_1_PIN == 11, "loopback request word");
+#endif
 
 #define READ  1 // return values from wait_for_request
 #define PUNCH 2
+#define BENCH 3
 
 #define REQUEST_FAIL       2
 #define REQUEST_END_FAIL   3
 #define LOGGING_FAIL       4
-#define TEST_FAIL          5
 #define EXIT_FAIL          6
 
 
 /**********************************************************/
-/*                         GLOBALS                        */
+/*                          TYPES                         */
 /**********************************************************/
 
 
-const uint32_t out_pins[OUT_PINS] =
-  { NOPOWER_PIN, ACK_PIN, II_AUTO_PIN, LED_PIN, 
-    RDR_1_PIN, RDR_2_PIN, RDR_4_PIN, RDR_8_PIN,
-    RDR_16_PIN, RDR_32_PIN, RDR_64_PIN,
-    RDR_128_PIN };
+// Single producer, single consumer ring buffer shared by the two
+// cores.  head is written only by the producer and tail only by the
+// consumer, so no locking is needed.  Both count up for ever and are
+// reduced modulo size (a power of 2) when indexing buf.
+
+typedef struct
+{
+  uint8_t *buf;
+  uint32_t size;
+  volatile uint32_t head;       // next free slot
+  volatile uint32_t tail;       // next character to take
+} ring_t;
+
+// Event log record written by core1, formatted later by core0
+
+typedef struct
+{
+  uint32_t time;                // hardware timer (uS)
+  uint32_t pins;                // gpio_get_all() at the time
+  uint32_t arg;                 // event specific
+  uint8_t  code;                // EV_...
+  uint8_t  ch;                  // character, if any
+} event_t;
+
+// Tape library directory entry, LIBRARY_TAPES fill a flash sector
+// which reads as all ones where entries are unused
+
+typedef struct
+{
+  uint32_t magic;               // LIBRARY_MAGIC if in use
+  uint32_t offset;              // of image from start of flash
+  uint32_t length;              // characters
+  uint32_t size;                // bytes of flash, less if TAPE_RLE
+  uint32_t flags;               // TAPE_BOOT, TAPE_RLE
+  char     name[TAPE_NAME_SIZE];
+} tape_entry_t;
+
+// Index of the blocks of a library tape, in the sector before it
+
+typedef struct
+{
+  uint32_t position;            // characters from start of tape
+  uint32_t offset;              // bytes from start of image to record
+  uint32_t skip;                // characters of record before position
+} index_entry_t;
+
+typedef struct
+{
+  uint32_t count;               // blocks, all ones if no index
+  index_entry_t blocks[INDEX_BLOCKS];
+} tape_index_t;
+
+// Run length decoder and coder state
+
+typedef struct
+{
+  uint32_t state;               // 0 or RLE_LITERAL, RLE_CHAR, RLE_RUNNING
+  uint32_t count;               // characters of record still to come
+  uint32_t ch;                  // character repeated by run
+} rle_decoder_t;
+
+typedef struct
+{
+  uint8_t  literal[RLE_LITERAL_MAX]; // literal span being gathered
+  uint32_t literal_count;
+  uint32_t run_ch;              // character being repeated
+  uint32_t run_count;           // and how many times so far
+} rle_coder_t;
+
+// Operator console command, standing for the host frame type or
+// an OP_..., with args the bytes of payload for each argument
+
+typedef struct
+{
+  const char *name;             // as typed
+  uint32_t type;                // H_... or OP_...
+  const char *args;             // payload bytes each argument makes
+  const char *usage;            // arguments, for help
+  const char *help;
+} operator_t;
+
+// Transfer recorded by core1
+
+typedef struct
+{
+  uint32_t time;                // request seen (uS)
+  uint8_t  ch;                  // character
+  uint8_t  device;              // HIST_READER, HIST_PUNCH or HIST_TTY
+  uint8_t  req_ack;             // request to ACK (uS, at most 255)
+  uint8_t  ack_clear;           // end of ACK to request cleared (uS, ditto)
+} trace_t;
+
+// Kept across a watchdog reset, in SRAM the start up code leaves
+// alone.  core0 copies in the counts and histograms every second
+// and core1 adds each transfer to the trace, going round.
+
+typedef struct
+{
+  uint32_t magic;               // POSTMORTEM_MAGIC once set up
+  uint32_t resets;              // watchdog resets since power on
+  uint32_t cause;               // PM_..., should the watchdog fire
+  uint32_t uptime;              // secs since start up
+  uint32_t busy;                // TRUE if core1 was in a handshake,
+  uint32_t device;              // which device's,
+  uint32_t word;                // its request word
+  uint32_t since;               // and how long since the request (uS)
+  uint32_t chars[2];            // characters moved, by direction
+  uint32_t errors[4];           // timeouts, retries, skips, resyncs
+  uint32_t events_dropped;
+  uint32_t hist[HIST_DEVICES][2][HIST_BUCKETS];
+  uint32_t trace_next;          // next entry for core1 to write
+  trace_t  trace[POSTMORTEM_TRACE];
+} postmortem_t;
+
+// Benchmark workload and its generator's state.  The computer
+// side follows the same sequence by running bench_next on a copy.
+
+typedef struct
+{
+  uint32_t workload;            // BENCH_READER ...
+  uint32_t pattern;             // BENCH_COUNT ...
+  uint32_t length;              // transfers
+  uint32_t seed;                // for BENCH_PRNG and random orders
+  uint32_t state;               // pseudo-random generator, from seed
+  uint32_t count;               // transfers generated so far
+  uint32_t last;                // last character read
+} bench_t;
+
+// Benchmark results, written by core1
+
+typedef struct
+{
+  uint32_t transfers;           // made
+  uint32_t errors;              // out of turn or wrong character
+  uint32_t timeouts;            // requests not clearing in time
+  uint32_t ended;               // BENCH_DONE, BENCH_STALLED or
+                                // BENCH_STOPPED
+  uint32_t elapsed;             // first request seen to last cleared (uS)
+  uint32_t max[2];              // longest HIST_REQ_ACK, HIST_ACK_CLEAR
+  uint32_t lat[2][BENCH_LAT_MAX]; // counts of each, the last bucket
+                                // holding BENCH_LAT_MAX - 1 and over
+} bench_result_t;
+
+#define BENCH_DONE    0 // all transfers made
+#define BENCH_STALLED 1 // no request for BENCH_STALL_US
+#define BENCH_STOPPED 2 // stopped by H_BENCH
+
+// Checksums of a tape
+
+typedef struct
+{
+  uint32_t crc;                 // sniffer's CRC-32, before finishing
+  uint32_t sum;                 // sum check
+  uint32_t length;              // characters
+  uint32_t last;                // when last character added (uS)
+} tape_sum_t;
+
+// Calibration sector, CONFIG_OFFSET
+
+typedef struct
+{
+  uint32_t magic;               // CONFIG_MAGIC if calibrated
+  uint32_t ack_ns;              // ACK pulse width
+  uint32_t timeout_us;          // handshake timeout
+  uint32_t release_us;          // longest release time measured
+  uint32_t min_ack_ns;          // shortest ACK that worked
+  uint32_t margin;              // percent added to each
+} config_t;
+
+// Header at the start of each sector of the punch capture log
+
+typedef struct
+{
+  uint32_t magic;               // CAPTURE_MAGIC if written
+  uint32_t sequence;            // counts sectors written, newest highest
+  uint32_t tape;                // number of tape the data belong to
+  uint16_t length;              // characters of tape in this sector
+  uint16_t flags;               // CAPTURE_END
+} capture_header_t;
+
+
+/**********************************************************/
+/*                         GLOBALS                        */
+/**********************************************************/
 
-const uint32_t in_pins[IN_PINS] =
-  { RDRREQ_PIN, PUNREQ_PIN, TTYSEL_PIN, PUN_1_PIN,
-    PUN_2_PIN, PUN_4_PIN, PUN_8_PIN, PUN_16_PIN,
-    PUN_32_PIN, PUN_64_PIN, PUN_128_PIN };
 
-uint32_t logging_enabled   = 0; // 1 = enable logging,
+volatile uint32_t logging_enabled = 0; // 1 = enable logging,
                                 // 0 = disable logging to usb
                                 // must default to 0 until set by reference to
                                 // LOG_PIN
 
-uint32_t read_request_bit   = 1 << RDRREQ_PIN;
-uint32_t punch_request_bit  = 1 << PUNREQ_PIN;
+static jmp_buf jbuf;            // used by setjmp in main, core0 only
+static volatile uint32_t core1_failed = 0; // fail code left by core1
+
+static uint32_t CORE1_DATA request_sm;     // state machine serving
+                                           // current transfer
+static uint32_t CORE1_DATA request_word;   // request word from it
+static uint32_t CORE1_DATA request_device; // HIST_READER, HIST_PUNCH, HIST_TTY
+static uint32_t CORE1_DATA time_seen;      // when request seen (uS)
+static uint32_t CORE1_DATA time_ack;       // when ACK started (uS)
+static uint32_t CORE1_DATA time_req_ack;   // request to ACK, last transfer
+static uint32_t CORE1_DATA time_ack_clear; // end of ACK to request cleared
+
+static uint32_t CORE1_DATA hist[HIST_DEVICES][2][HIST_BUCKETS]; // latencies
+
+static volatile uint32_t woken = FALSE; // set by request edge when idle
+static volatile uint32_t wake_time;     // when (uS)
+static uint32_t wake_count = 0;         // wake ups from idle by request
+static uint32_t wake_max = 0;           // longest wake up latency (uS)
+static uint32_t wake_sum = 0;           // total wake up latency (uS)
+static const char *hist_names[HIST_DEVICES] = { "reader", "punch", "tty" };
+
+static volatile uint32_t pacing = FALSE; // TRUE to pace, set by core0
+static volatile uint32_t pace_period[HIST_DEVICES] = // uS per character,
+  { 1000000 / PACE_READER_CPS,                        // 0 for no pacing
+    1000000 / PACE_PUNCH_CPS,
+    1000000 / PACE_TTY_CPS };
+static uint32_t CORE1_DATA pace_last[HIST_DEVICES]; // when each device
+                                                   // last ACKed (uS)
+static volatile uint32_t pace_sm;        // state machine and word for
+static volatile uint32_t pace_word;      // pace_irq to put
+static volatile uint32_t pace_time;      // when it did (uS)
+static volatile uint32_t pace_waiting = FALSE; // TRUE until it has
+static uint32_t CORE1_DATA punch_primed = FALSE; // punch go ahead queued
+
+static postmortem_t __uninitialized_ram(postmortem); // survives reset
+static postmortem_t postmortem_last;      // as found at start up
+static uint32_t postmortem_found = FALSE; // TRUE if watchdog reset
+static volatile uint32_t CORE1_DATA core1_busy = FALSE; // in a handshake
+static volatile uint32_t CORE1_DATA core1_due; // which should end by (uS)
+static uint32_t stalled = FALSE;          // core0 has stopped feeding
+static trace_t  trace[TRACE_ENTRIES];
+static volatile uint32_t trace_count = 0;  // entries, written by core1
+static volatile uint32_t recording = FALSE; // set by core0, core1 clears
+static volatile uint32_t replaying = FALSE; // when full or finished
+static uint32_t replay_pos;              // next entry to replay
+static uint32_t replay_ack;              // when its predecessor ACKed
+static uint32_t replay_started;          // FALSE until first replayed
+static uint32_t replay_gap;              // hold next reader ACK back (uS)
+static bench_t  bench;                     // set up by core0
+static bench_result_t bench_result;        // written by core1
+static volatile uint32_t bench_pending = FALSE; // set by core0, cleared
+                                           // by core1 when run finished
+static volatile uint32_t bench_stop = FALSE; // set by core0 to end it
+static uint32_t benchmarking = FALSE;      // TRUE while core1 runs it
+static uint32_t bench_started = FALSE;     // core0: results to come
+static uint32_t bench_ran = FALSE;         // core0: results to report
+static const char *bench_workloads[] =
+  { "reader", "punch", "alternate", "random", "ttysel" };
+static const char *bench_patterns[] = { "count", "prng", "blank", "ones" };
+#if PTS_LOOPBACK
+static bench_t  loop_bench;              // workload played by core0
+static uint32_t loop_offset;             // where pts_computer is loaded
+static uint32_t loop_gap;                // cycles between requests
+static uint32_t loop_active = FALSE;     // TRUE until all made
+static uint32_t loop_service = FALSE;    // TRUE if run by H_LOOP
+static uint8_t  loop_expect[LOOP_EXPECT]; // characters due to be read
+static uint32_t loop_head, loop_tail;    // count up, as for rings
+static uint32_t loop_errors;             // characters read wrongly
+#endif
+static volatile uint32_t error_policy[HIST_DEVICES] = // ERR_..., set by
+  { ERROR_POLICY, ERROR_POLICY, ERROR_POLICY };      // core0
+static uint32_t err_timeouts = 0; // requests not cleared in time,
+static uint32_t err_retries = 0;  // waited for again,
+static uint32_t err_skips = 0;    // abandoned
+static uint32_t err_resyncs = 0;  // and state machines restarted
+static uint32_t CORE1_DATA stale[2] = { 0, 0 }; // PTS_PIO_DONEs to throw
+                                                // away, by state machine
+static const char *err_names[] = { "halt", "retry", "skip", "resync" };
+static uint32_t rdr_offset;     // where reader program is loaded
+static const pio_program_t *rdr_program = NULL; // and which one
+static uint32_t pun_offset;     // where punch program is loaded
+static uint32_t sys_mhz;        // system clock (MHz)
+static uint32_t ack_ns;         // ACK pulse width (nS),
+static uint32_t ack_cycles;     // and in PIO cycles
+static uint32_t CORE1_DATA poll_limit = POLL_LIMIT; // handshake timeout
+
+static const config_t *config = (const config_t *)
+  (XIP_BASE + CONFIG_OFFSET);
+static volatile uint32_t cal_pending = FALSE; // set by core0, cleared by
+                                // core1 once calibrated
+static uint32_t cal_started = FALSE; // core0: results to come
+static config_t cal_result;     // written by core1
+static uint32_t cal_active = FALSE; // core1: calibrating
+static uint32_t cal_phase;      // CAL_...
+static uint32_t cal_count;      // transfers at this step
+static uint32_t cal_release;    // longest release so far (uS)
+static uint32_t cal_limit;      // release longer than this is a miss (uS)
+static uint32_t cal_good;       // shortest ACK that worked (nS)
+static uint32_t cal_want;       // ACK width to change to (nS)
+static uint32_t cal_missed;     // TRUE once a request was missed
+static uint32_t cal_unstaged;   // TRUE once nothing staged or primed
+
+
+static uint32_t dma_chan[2];    // ping-pong pair of DMA channels
+static dma_channel_config dma_config[2];
+static const uint8_t *dma_next; // next block to queue
+static const uint8_t *dma_end;  // end of tape being streamed
+static volatile uint32_t dma_queued; // count of blocks queued but not done
+static volatile uint32_t reader_streaming = FALSE; // TRUE while DMA
+                                                   // feeds reader
+static uint32_t stream_last;    // last reader word seen while streaming
+static volatile uint32_t stream_paused = FALSE; // TRUE while stream is
+                                                // held for teleprinter
+static const uint8_t *stream_resume; // where the held stream carries on
+static uint32_t stream_left;    // and how much of it there is
+
+static uint8_t  reader_buf[READER_RING_SIZE];
+static ring_t   reader_ring = { reader_buf, READER_RING_SIZE, 0, 0 };
+static uint32_t reader_filling = TRUE; // TRUE while core0 reading USB
+
+static uint8_t  punch_buf[PUNCH_RING_SIZE];
+static ring_t   punch_ring = { punch_buf, PUNCH_RING_SIZE, 0, 0 };
+
+static uint8_t  printer_buf[PRINTER_RING_SIZE];
+static ring_t   printer_ring = { printer_buf, PRINTER_RING_SIZE, 0, 0 };
+static uint8_t  keyboard_buf[KEYBOARD_RING_SIZE];
+static ring_t   keyboard_ring = { keyboard_buf, KEYBOARD_RING_SIZE, 0, 0 };
+
+static const char telecode[2][33] = // 5 hole code in letter, figure shift
+  { "\0ABCDEFGHIJKLMNOPQRSTUVWXYZ\0 \r\n\0",
+    "\0" "12*4$=78',+:-.%0()3?56/@9\243\0 \r\n\0" };
+static uint8_t  console_in[2][256]; // ASCII to 5 hole (with shift), 8 hole
+static uint8_t  console_out8[128];  // 8 hole to ASCII
+static uint32_t console_code = CONSOLE_CODE; // CODE_...
+static uint32_t printer_shift = 0;  // 5 hole: 1 if figures
+static uint32_t keyboard_shift = 0; // 5 hole: TELE_LETTERS, TELE_FIGURES
+                                    // or 0 if not yet sent
 
-static jmp_buf jbuf;            // used by setjmp in main
+static volatile uint32_t chars[2]; // characters moved, by direction,
+                                   // written only by core1
+static uint64_t chars_total[2];    // core0's 64 bit copies
+static uint64_t chars_history[2][RATE_HISTORY]; // totals at each second
+
+extern char __flash_binary_end; // from the linker script
+
+static const tape_entry_t *library_dir = (const tape_entry_t *)
+  (XIP_BASE + LIBRARY_OFFSET);  // directory, read through XIP
+static uint32_t library_ok = FALSE; // TRUE if program clear of library
+static uint8_t  sector_buf[FLASH_SECTOR_SIZE]; // sector being written
+static uint32_t store_active = FALSE; // TRUE while storing a tape
+static tape_entry_t store_entry;      // and its directory entry
+static uint32_t store_expected;       // size promised by the host
+static uint32_t store_fill;           // bytes in sector_buf
+static rle_decoder_t store_rle;       // decodes tape if coded
+static tape_index_t store_index;      // being built
+static uint32_t store_mark;           // blanks between blocks or marker
+static uint32_t store_blanks;         // blanks just stored
+static uint32_t store_record;         // offset of coded record
+static uint32_t store_skip;           // characters of it so far
+static uint32_t store_crc;            // of characters stored
+static uint32_t mounted = LIBRARY_TAPES; // tape mounted
+
+static const uint8_t *tape_next = NULL; // coded tape being decoded by
+static const uint8_t *tape_end;         // core0 into the reader ring
+static uint32_t tape_coded;             // TRUE if run length coded
+static rle_decoder_t tape_rle;
+
+static const uint8_t *volatile mount_tape; // tape for core1 to mount,
+static volatile uint32_t mount_length;     // NULL to unmount
+static volatile uint32_t mount_flush;      // empty reader ring first
+static volatile uint32_t mount_pending = FALSE; // set by core0,
+                                                // cleared by core1
+
+static volatile uint32_t flash_busy = FALSE;    // set by core0 writing flash
+static volatile uint32_t core1_in_flash = TRUE; // set by core1 running from
+                                                // flash, TRUE until started
+static uint32_t stream_held = FALSE;  // core0: reader held for a write
+
+static uint32_t capture_ok = FALSE; // TRUE if program clear of log
+static uint8_t  capture_buf[2][FLASH_SECTOR_SIZE]; // sectors being filled
+static uint32_t capture_full[2] = { FALSE, FALSE }; // waiting to be written
+static uint32_t capture_fill_buf = 0;   // buffer being filled
+static uint32_t capture_write_buf = 0;  // buffer to be written next
+static uint32_t capture_fill = 0;       // characters in buffer being filled
+static uint32_t capture_next;           // next log sector to write
+static uint32_t capture_erased = FALSE; // TRUE once it has been erased
+static uint32_t capture_sequence;       // of next sector written
+static uint32_t capture_tape;           // number of tape being punched
+static uint32_t capture_open = FALSE;   // TRUE once it has characters
+static uint32_t capture_lost = 0;       // characters there was no room for
+static uint32_t capture_tape_lost = 0;  // of them, from tape being captured
+static uint32_t capture_last;           // when last character captured (uS)
+static rle_coder_t capture_rle;         // coder for sector being filled
+
+static uint8_t  host_buf[64];   // input from USB
+static uint32_t host_len = 0, host_pos = 0; // bytes, and next to take
+static uint32_t host_state = 0; // bytes of frame header seen
+static uint32_t host_type;      // frame type, H_...
+static uint32_t host_left;      // payload still to come
+static uint8_t  host_cmd[HOST_CMD_MAX]; // command payload
+static uint32_t host_cmd_len;
+static rle_decoder_t host_rle;  // decodes H_TAPE_RLE frames
+static uint32_t host_bulk = FALSE;     // TRUE if frame came by bulk USB
+static uint32_t host_replying = FALSE; // TRUE while obeying frames
+static uint32_t punch_bulk = FALSE;    // TRUE while H_LISTEN in force
+static uint32_t punch_lease;           // when H_LISTEN last renewed (uS)
+static uint32_t punch_unsent = 0;      // characters the host missed
+static uint32_t host_chars = 0;        // tape characters taken from host
+
+static uint32_t sum_chan;               // DMA channel for the sniffer
+static dma_channel_config sum_config;
+static uint8_t  sum_sink;               // where it copies to
+static uint32_t sum_scale;              // undoes the sniffer's view of
+                                        // a byte in SNIFF_SUM
+static tape_sum_t read_sum, punch_sum;  // tapes being read and punched
+static tape_sum_t read_done, punch_done; // and the last finished
+static uint32_t read_summed;            // reader ring tail summed up to
+static uint32_t read_resync = FALSE;    // TRUE until mount flushes ring
+static const uint8_t *sum_stream = NULL; // DMA stream to add when done
+static uint32_t sum_stream_left;
+
+static void console_out_chars(const char *s, int n);
+static stdio_driver_t console_driver = // stdio on the CDC serial port
+  {
+    .out_chars = console_out_chars,
+#if PICO_STDIO_ENABLE_CRLF_SUPPORT
+    .crlf_enabled = PICO_STDIO_DEFAULT_CRLF
+#endif
+  };
+
+static event_t   event_ring[EVENT_RING_SIZE]; // core1 to core0 event log
+static volatile uint32_t event_head = 0; // written by core1
+static volatile uint32_t event_tail = 0; // written by core0
+static volatile uint32_t events_dropped = 0; // written by core1
+static volatile uint32_t log_transfers = FALSE; // log every character?
+static uint32_t log_pin;           // LOG_PIN as last seen
+static volatile uint32_t counts_reset = FALSE; // set by core0, cleared
+                                   // by core1 once it has
+static uint32_t operator_state = OP_IDLE; // OP_...
+static char     operator_line[OPERATOR_MAX]; // command being typed
+static uint32_t operator_len;
+static uint32_t dump_pos = 0, dump_end = 0; // trace still to print
+static const operator_t operators[] =
+  {
+    { "help",    OP_HELP,   "",         "",   "list commands" },
+    { "mount",   H_MOUNT,   "\1\1",     "N [boot]", "mount library tape N" },
+    { "unmount", H_UNMOUNT, "\1",       "[boot]", "stop reading tape, boot"
+                                        " clears boot flag" },
+    { "seek",    H_SEEK,    "\2",       "B",  "go to block B of tape" },
+    { "list",    H_LIST,    "",         "",   "list library" },
+    { "punched", H_PUNCHED, "",         "",   "list captured punch tapes" },
+    { "pace",    H_PACE,    "\1\2\2\2", "on|off [R P T]", "pacing, and cps for"
+                                        " reader, punch, teleprinter" },
+    { "trace",   H_TRACE,   "\1",       "stop|record|replay", "transfer trace" },
+    { "dump",    OP_DUMP,   "",         "",   "print the trace" },
+    { "hist",    OP_HIST,   "",         "",   "print latency histograms" },
+    { "stats",   H_STATS,   "",         "",   "characters moved, ring levels" },
+    { "errors",  H_ERRORS,  "\1\1\1",   "[POLICY ...]", "halt, retry, skip or"
+                                        " resync, by device" },
+    { "reset",   OP_RESET,  "",         "",   "reset counts and histograms" },
+    { "log",     OP_LOG,    "\1",       "[on|off|all]", "logging, all logs"
+                                        " every transfer" },
+    { NULL }
+  };
+static const char *operator_words[] =
+  { "off", "on", "all", "boot", "stop", "record", "replay", NULL };
+static const uint8_t operator_values[] =
+  { FALSE, TRUE, LOG_ALL, TRUE, TRACE_STOP, TRACE_RECORD, TRACE_REPLAY };
 
-static uint64_t cycles;         // used in diagnostic code
-static uint32_t max_poll = 0;
 static uint32_t monitoring = FALSE;
+static uint32_t power_start;        // when NOPOWER raised at start up (uS)
+static uint32_t power_quiet;        // when requests last seen high (uS)
+static uint32_t powered = FALSE;    // TRUE once NOPOWER released
 
 
 /**********************************************************/
@@ -196,24 +1222,172 @@ static uint32_t monitoring = FALSE;
 /**********************************************************/
 
 static  void     set_up_gpios();               // initialize GPIO interface 
+static  void     set_up_pio();                 // start handshake state machines
 static  void     led_on();                     // turn onboard LED on
 static  void     led_off();                    // turn onboard LED off
 static  uint32_t logging();                    // TRUE is logging enabled
-static  uint32_t ack();                        // signal an ACK
 static  void     set_power_on();               // set NOPOWER LOW
 static  void     set_power_off();              // set NOPOWER HIGH
+static  void     power_poll();                 // release NOPOWER when ready
+static  void     connect_poll();               // greet host on connecting
 static  uint32_t wait_for_request();           // wait for RDR or PUN request
 static  void     put_pts_ch(const uint32_t ch);// send from paper tape reader
 static  uint32_t get_pts_ch();                 // receive from paper tape punch
 static  uint32_t wait_for_request();           // wait for reader or punch request
-static  void     wait_for_no_request();        // wait until request cleared
+static  uint32_t wait_for_no_request();        // wait until request cleared
+static  void     request_resync();             // restart after request drops
+static  void     core1_fail(uint32_t code);    // park core1, core0 halts
+static  void     restart_sm(uint32_t sm);      // start state machine afresh
+static  void     sm_set_enabled(uint32_t sm, uint32_t on); // atomically
+static  void     ack_width(uint32_t ns);       // set ACK pulse width
+static  void     cal_step();                   // calibrate (core1)
+static  uint32_t cal_apply();                  // set cal_want between transfers
+static  void     cal_settle();                 // choose final values
+static  void     cal_finish();                 // calibration done (core1)
+static  void     cal_reack();                  // pulse ACK again
+static  void     cal_command();                // calibrate from host
+static  void     cal_poll();                   // keep results (core0)
+static  void     error_command();              // error policy from host
 static  uint32_t teletype();                   // TRUE if teletype selected
 static void      pts_emulation();              // paper tape station emulation
+static void      set_up_core1();               // core1's start up, from flash
+static  void     set_up_dma();                 // claim DMA reader channels
+static  void     reader_stream_start(const uint8_t *tape, uint32_t length);
+                                               // start DMA reader stream
+static  void     reader_stream_poll();         // track DMA reader stream
+static  void     reader_stream_stop();         // abandon DMA reader stream
+static  const uint8_t *reader_stream_next();   // next tape char unread
+static  void     set_reader_program(const pio_program_t *program);
+                                               // (re)load reader program
+static  void     stage_reader();               // offer next char to reader
+static  void     set_up_pace();                // claim pacing alarm
+static  void     pace_put(uint32_t sm, uint32_t word); // put word when due
+static  void     pace_command();               // set pacing from host
+static  void     trace_add(uint32_t ch);       // record transfer (core1)
+static  uint32_t replay_next(uint32_t *ch);    // next character replayed
+static  void     set_up_watchdog();            // keep post-mortem, start
+static  void     watchdog_poll();              // feed it unless stalled
+static  void     stall_set(uint32_t busy, uint32_t due); // core1 progress
+static  void     postmortem_add(uint32_t ch);  // record transfer (core1)
+static  void     postmortem_save(uint32_t cause); // copy counts for reset
+static  void     postmortem_print();           // report watchdog reset
+static  void     trace_command();              // trace from host
+static  uint32_t bench_random(bench_t *b);     // next pseudo-random number
+static  uint32_t bench_next(bench_t *b, uint32_t *tty, uint32_t *ch);
+                                               // next transfer of workload
+static  void     bench_run();                  // run benchmark (core1)
+static  void     bench_command();              // benchmark from host
+static  void     bench_poll();                 // report when done (core0)
+static  void     bench_print(const char *prefix); // print results
+static  uint32_t bench_percentile(const uint32_t *lat, uint32_t n,
+				  uint32_t permille);
+#if PTS_LOOPBACK
+static  void     set_up_loopback();            // load computer side
+static  void     loopback_start(const bench_t *b, uint32_t gap_us);
+                                               // play workload b
+static  void     loopback_poll();              // feed computer side
+static  void     loop_command();               // loopback service
+static  void     loop_print(const char *prefix); // print results
+#endif
+static  void     set_up_idle();                // claim request edge interrupt
+static  void     request_edges(uint32_t enable); // arm request edge interrupt
+static  void     idle_wait();                  // sleep until a request edge
+static  void     hist_add(uint32_t kind, uint32_t us); // count a latency
+static  void     print_histograms();           // print latency histograms
+static  void     hist_print(uint32_t h[HIST_DEVICES][2][HIST_BUCKETS]);
+                                               // print a set of them
+static  void     sample_chars(uint32_t secs);  // update character totals
+static  uint32_t chars_rate(uint32_t dir, uint32_t secs, uint32_t window);
+                                               // chars/sec over window
+static  void     log_event(uint32_t code, uint32_t ch, uint32_t arg);
+                                               // record event (core1)
+static  void     log_poll();                   // print events (core0)
+static  uint32_t ring_count(ring_t *r);        // characters in ring
+static  uint32_t ring_free(ring_t *r);         // space left in ring
+static  uint32_t ring_get(ring_t *r);          // take next char, spin if empty
+static  uint32_t ring_peek(ring_t *r);         // next char, ring not empty
+static  void     ring_skip(ring_t *r);         // discard next char
+static  uint32_t ring_write(ring_t *r, const uint8_t *s, uint32_t n);
+                                               // add up to n chars
+static  void     ring_put(ring_t *r, uint32_t ch); // add char, spin if full
+static  uint32_t ring_read(ring_t *r, uint8_t *s, uint32_t n);
+                                               // take up to n chars
+static  void     set_up_library();             // check library, mount boot tape
+static  uint32_t flash_begin();                // core0 about to write flash
+static  void     flash_end();                  // core0 finished writing
+static  uint32_t reader_dma_done();            // stream all transferred
+static  uint32_t flash_enter();                // core1 about to run from flash
+static  void     flash_exit();                 // core1 back in SRAM
+static  uint32_t flash_write(uint32_t offset, const uint8_t *data,
+                             uint32_t erase);  // write a flash sector
+static  void     library_list();               // print library directory
+static  void     library_mount(uint32_t n, uint32_t boot); // mount tape n
+static  void     library_seek(uint32_t block); // reposition mounted tape
+static  void     tape_start(const tape_entry_t *e, const index_entry_t *b,
+                            uint32_t flush);   // have tape read from b
+static  void     store_index_char(uint32_t ch, uint32_t offset,
+                                  uint32_t skip); // index tape stored
+static  void     library_erase();              // empty library
+static  void     store_begin();                // start storing a tape
+static  void     store_data(const uint8_t *s, uint32_t n); // store tape
+static  void     store_end();                  // finish storing a tape
+static  void     set_up_capture();             // find end of capture log
+static  uint32_t capture_room();               // space for punch output
+static  void     capture_add(const uint8_t *s, uint32_t n); // capture output
+static  void     capture_spare(const uint8_t *s, uint32_t n); // as room allows
+static  void     capture_close(uint32_t end);  // sector ready for flash
+static  void     capture_poll();               // write capture log (core0)
+static  void     capture_list();               // print captured tapes
+static  void     capture_get(uint32_t tape);   // send captured tape to host
+static  uint32_t rle_decode(rle_decoder_t *d, const uint8_t **in,
+                            const uint8_t *end, uint8_t *out, uint32_t n);
+                                               // decode up to n chars
+static  uint32_t rle_length(const uint8_t *s, uint32_t n); // chars coded
+static  uint32_t rle_code(rle_coder_t *c, uint32_t ch, uint8_t *out);
+                                               // code a character
+static  uint32_t rle_finish(rle_coder_t *c, uint8_t *out); // flush coder
+static  uint32_t reader_room();                // space core0 may fill
+static  uint32_t reader_fill(const uint8_t *s, uint32_t n); // add tape
+static  uint32_t reader_decode(rle_decoder_t *d, const uint8_t **in,
+                               const uint8_t *end, uint32_t max);
+                                               // decode tape into ring
+static  void     tape_poll();                  // decode mounted tape
+static  uint32_t crc32_add(uint32_t crc, uint32_t ch); // add to CRC-32
+static  void     set_up_sums();                // claim sniffer channel
+static  void     sum_reset(tape_sum_t *t);     // start a tape's sums
+static  uint32_t sum_sniff(uint32_t mode, uint32_t seed, const uint8_t *s,
+                           uint32_t n);        // one pass of the sniffer
+static  void     sum_add(tape_sum_t *t, const uint8_t *s, uint32_t n);
+                                               // add characters to sums
+static  void     sum_end(tape_sum_t *t, tape_sum_t *done, const char *what);
+                                               // tape ended, report sums
+static  void     sum_print(const tape_sum_t *t, const char *what);
+static  void     read_sum_poll();              // sum reader characters used
+static  void     sum_poll();                   // end idle tapes (core0)
+static  void     host_poll();                  // process input from host
+static  void     host_read();                  // parse frames from host
+static  void     usb_write(uint32_t bulk, const uint8_t *s, uint32_t n);
+                                               // send on USB, waiting
+static  void     usb_sleep_ms(uint32_t ms);    // sleep, servicing USB
+static  void     host_write(const uint8_t *s, uint32_t n); // send to host
+static  void     host_command();               // obey a complete frame
+static  void     usb_punch_poll();             // move punch ring to USB
+static  void     console_poll();               // move printer ring to USB
+static  void     set_up_console();             // build code tables
+static  void     console_type(uint32_t ch);    // keyboard input from host
+static  uint32_t console_translate(const uint8_t *in, uint32_t n,
+                                   uint8_t *out); // printer output to ASCII
+static  void     console_command();            // set code from host
+static  uint32_t operator_type(uint32_t ch);   // console input, TRUE if taken
+static  void     operator_command(char *line); // obey a command line
+static  uint32_t operator_value(const char *word, uint32_t *value);
+                                               // argument's value
+static  void     operator_help();              // list commands
+static  void     operator_poll();              // print trace, follow LOG_PIN
+static  void     counts_clear();               // reset counts (core1)
 
 // Test routines used during development only 
 static void signals();
-static void reader_test(uint64_t max_cycles);
-static void punch_test(uint64_t max_cycles);
 static void monitor();
 
 
@@ -227,47 +1401,48 @@ int main() {
 
   bi_decl(bi_program_description("Elliott 900 PTS Emulator by Andrew Herbert"));
 
+  tusb_init(); // USB, serviced by tud_task()
   stdio_init_all(); // initialise stdio
+  stdio_set_driver_enabled(&console_driver, TRUE); // on CDC
   set_up_gpios(); // configure interface to outside world
+  set_up_pio(); // and hand the handshakes to the PIO
+#if PTS_LOOPBACK
+  set_up_loopback(); // and the computer side to pio1
+#endif
 
   // set local flags based on external inputs
-  logging_enabled = logging();     // print logging messages to usb?
-
-  if ( logging_enabled )
-    {
-      while ( !tud_cdc_connected() )
-	sleep_ms(500); // wait for usb to wake up
-      puts("\n\n\nPicoPTS Starting");
-    }
+  logging_enabled = log_pin = logging(); // print logging messages to usb?
 
   // long jump to here on error
   if ( fail_code = setjmp(jbuf) ) // test if a longjmp occurred
     {
       monitoring = FALSE; // disable conflicting monitoring i/o
+      hw_clear_bits(&watchdog_hw->ctrl, WATCHDOG_CTRL_ENABLE_BITS); // halt
       set_power_off(); // and stop 920M
-      sleep_ms(2000); // allow system to quiesce
+      usb_sleep_ms(2000); // allow system to quiesce
       if ( logging_enabled )
 	printf("PicoPTS halted after error with code %d"
 	       " - push reset to restart\n",fail_code);
       while ( TRUE )  // loop until reset flashing the code
 	{
-	  sleep_ms(1000);
+	  usb_sleep_ms(1000);
 	  for ( uint32_t j = 1 ; j <= fail_code ; j++ )
 	    {
-	      led_on(); sleep_ms(250);led_off(); sleep_ms(100);
+	      led_on(); usb_sleep_ms(250);led_off(); usb_sleep_ms(100);
 	    }
 	}
     }
   
-  // Reset 920M
-  gpio_put(ACK_PIN, 0);
-  if ( logging_enabled ) puts("Power on 920M now!");
+  // Reset 920M, released by power_poll once it is ready
   set_power_off();
-  sleep_ms(5000); // wait for 920M
-  if ( logging_enabled ) puts("Resetting 920M");
-  set_power_on();
-  
+  power_start = power_quiet = time_us_32();
+
+  set_up_console();
+  set_up_sums();
+  set_up_watchdog(); // before core1 adds to the post-mortem trace
   multicore_launch_core1(pts_emulation);
+  set_up_library();
+  set_up_capture();
   monitor();
   longjmp(jbuf, EXIT_FAIL); // STOP HERE
 
@@ -286,76 +1461,167 @@ int main() {
 /**********************************************************/
 
 
-static inline void reader_test(uint64_t max)
+/* Pseudo-random numbers, xorshift32 */
+
+static inline uint32_t __not_in_flash_func(bench_random)(bench_t *b)
 {
-  if ( logging_enabled )
-    puts("PicoPTS reader test starting");
-  else
-    {
-      puts("PicoPTS reader test - no logging - stopping");
-      longjmp(jbuf, LOGGING_FAIL);
-      /* NOT REACHED */
-    }
-  for ( cycles = 0 ; cycles < max ; cycles++ )
-    {
-      if ( wait_for_request() != READ )
-	{
-	  printf("Got PUNREQ in reader test at cycle %"PRIu64"\n", cycles);
-	  longjmp(jbuf, REQUEST_FAIL);
-	  /* NOT REACHED */
-	}
-      put_pts_ch(cycles&255);
-    }
-  puts("Reader test complete");
+  uint32_t x = b->state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return b->state = x;
 }
 
-static inline void punch_test(uint64_t max)
+/* Next transfer of a benchmark workload, READ or PUNCH, whether it */
+/* is to the teleprinter and the character read or to be punched.  */
+/* Both sides call this, starting with state set to seed and count */
+/* to 0, and so agree on the sequence.                            */
+
+static inline uint32_t __not_in_flash_func(bench_next)(bench_t *b,
+						       uint32_t *tty,
+						       uint32_t *ch)
 {
-  if ( logging_enabled )
-    puts("PicoPTS punch test starting");
-  else
+  uint32_t dir, r, n = b->count++;
+  *tty = FALSE;
+  switch ( b->workload )
     {
-      puts("PicoPTS punch test - no logging - stopped");
-      longjmp(jbuf, LOGGING_FAIL);
-      /* NOT REACHED */
+    case BENCH_READER:
+      dir = READ;
+      break;
+    case BENCH_PUNCH:
+      dir = PUNCH;
+      break;
+    case BENCH_ALTERNATE:
+      dir = n & 1 ? PUNCH : READ;
+      break;
+    default:
+      r = bench_random(b);
+      dir = r & 1 ? PUNCH : READ;
+      *tty = b->workload == BENCH_TTYSEL && (r & 2);
     }
-  for ( cycles = 0 ; cycles < max; cycles++ )
+  if ( b->workload == BENCH_ALTERNATE && dir == PUNCH )
+    *ch = b->last; // punched back
+  else
+    switch ( b->pattern )
+      {
+      case BENCH_COUNT: *ch = n & 255; break;
+      case BENCH_PRNG:  *ch = bench_random(b) >> 24; break;
+      case BENCH_BLANK: *ch = 0; break;
+      default:          *ch = 255;
+      }
+  if ( dir == READ ) b->last = *ch;
+  return dir;
+}
+
+/* Serve the benchmark workload set up by core0, checking each      */
+/* transfer against it.  Nothing is staged meanwhile, so each read  */
+/* is handed the character due.  Out of turn transfers are served   */
+/* all the same, so the computer carries on.                        */
+
+static void __not_in_flash_func(bench_run)()
+{
+  bench_t b = bench;
+  bench_result_t *res = &bench_result;
+  uint32_t dir, tty, ch, got, wait, timeouts, start = 0, end = 0;
+  res->transfers = res->errors = res->timeouts = 0;
+  res->ended = BENCH_DONE;
+  res->max[HIST_REQ_ACK] = res->max[HIST_ACK_CLEAR] = 0;
+  for ( uint32_t i = 0 ; i < BENCH_LAT_MAX ; i++ )
+    res->lat[HIST_REQ_ACK][i] = res->lat[HIST_ACK_CLEAR][i] = 0;
+  b.state = b.seed;
+  b.count = b.last = 0;
+  timeouts = err_timeouts;
+  benchmarking = TRUE;
+  while ( b.count < b.length )
     {
-      uint32_t got, expected = cycles&255;
-      if ( wait_for_request() != PUNCH )
+      dir = bench_next(&b, &tty, &ch);
+      wait = time_us_32();
+      while ( pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM)
+	      && pio_sm_is_rx_fifo_empty(PTS_PIO, PUN_SM) )
+	if ( bench_stop )
+	  {
+	    res->ended = BENCH_STOPPED;
+	    break;
+	  }
+	else if ( res->transfers // no limit on the wait for the first
+		  && time_us_32() - wait > BENCH_STALL_US )
+	  {
+	    res->ended = BENCH_STALLED;
+	    break;
+	  }
+      if ( res->ended != BENCH_DONE ) break;
+      if ( wait_for_request() != dir || (request_device == HIST_TTY) != tty )
 	{
-	  printf("Got RDRREQUEST in punch test at cycle %"PRIu64"\n",
-		 cycles);
-	  longjmp(jbuf, REQUEST_FAIL);
-	  /* NOT REACHED */
+	  res->errors++;
+	  log_event(EV_WRONG_REQUEST, 0, dir);
 	}
-      got = get_pts_ch(); 
-      if  ( got != expected )
+      if ( request_sm == RDR_SM )
+	put_pts_ch(ch);
+      else if ( (got = get_pts_ch()) != ch && dir == PUNCH )
 	{
-	  printf("Failed after %"PRIu64" cycles got %u, expected %u\n",
-		 cycles, got, expected);
-	  longjmp(jbuf, TEST_FAIL);
-	  /* NOT REACHED */
+	  res->errors++;
+	  log_event(EV_TEST_FAIL, got, ch);
 	}
+      end = time_us_32();
+      if ( res->transfers++ == 0 ) start = time_seen;
+      res->lat[HIST_REQ_ACK][MIN(time_req_ack, BENCH_LAT_MAX - 1)]++;
+      res->lat[HIST_ACK_CLEAR][MIN(time_ack_clear, BENCH_LAT_MAX - 1)]++;
+      if ( time_req_ack > res->max[HIST_REQ_ACK] )
+	res->max[HIST_REQ_ACK] = time_req_ack;
+      if ( time_ack_clear > res->max[HIST_ACK_CLEAR] )
+	res->max[HIST_ACK_CLEAR] = time_ack_clear;
     }
-  puts("Punch test complete");
+  res->elapsed = end - start;
+  res->timeouts = err_timeouts - timeouts;
+  benchmarking = FALSE;
+  __dmb(); // publish results before finishing
+  bench_pending = FALSE;
 }
 
+/* core0 loop, services USB between LED blinks */
+
 static inline void monitor()
 {
+  uint32_t next = time_us_32() + 1000000;
   monitoring = TRUE;
-  for ( uint32_t tick = 1 ; ; tick++ )
+  led_on();
+  for ( uint32_t tick = 1 ; ; )
     {
-      for ( uint32_t i = 0 ; i < 5 ; i++ )
+      tud_task();
+      if ( core1_failed ) longjmp(jbuf, core1_failed); // core1 parked
+      power_poll();
+      connect_poll();
+      host_poll();
+      tape_poll();
+      console_poll();
+      usb_punch_poll();
+      sum_poll();
+      capture_poll();
+      log_poll();
+#if PTS_LOOPBACK
+      loopback_poll();
+#endif
+      bench_poll();
+      cal_poll();
+      operator_poll();
+      watchdog_poll();
+      if ( (int32_t) (time_us_32() - next) < 0 ) continue;
+      next += 1000000;
+      if ( tick & 1 ) led_off(); else led_on();
+      sample_chars(tick);
+      if ( !stalled ) postmortem_save(PM_WATCHDOG);
+      if ( (tick++ % 10) != 0 ) continue;
+      if ( monitoring && logging_enabled )
 	{
-	  led_on();
-	  sleep_ms(1000);
-          led_off();
-	  sleep_ms(1000);
+	  printf("Time %7u secs", tick-1);
+	  for ( uint32_t dir = DIR_IN ; dir <= DIR_OUT ; dir++ )
+	    printf(", %s %10"PRIu64" chars %5u/%5u/%5u cps",
+		   dir == DIR_IN ? "in" : "out", chars_total[dir],
+		   chars_rate(dir, tick-1, 1), chars_rate(dir, tick-1, 10),
+		   chars_rate(dir, tick-1, 60));
+	  putchar('\n');
+	  if ( ((tick-1) % HIST_PERIOD) == 0 ) print_histograms();
 	}
-      if ( monitoring && logging_enabled )
-	printf("Time %7u secs %10"PRIu64" cycles, max poll %4u\n",
-	       tick*10, cycles, max_poll);
     }
 }
 
@@ -364,36 +1630,110 @@ static inline void monitor()
 /**********************************************************/
 
 
-static void pts_emulation()
+static void __not_in_flash_func(pts_emulation)()
 {
+  uint32_t ch, request;
+  ring_t *ring;
+  while ( !flash_enter() ) tight_loop_contents(); // set up runs from flash
+  set_up_core1();
+  flash_exit();
   while ( TRUE )
     {
-      punch_test(10000000);
-      sleep_ms(1);
-      reader_test(10000000);
+      if ( (request = wait_for_request()) == BENCH )
+	bench_run();
+      else if ( request == READ )
+	{
+	  if ( request_word == PTS_PIO_STAGED )
+	    {
+	      ch = ring_peek(&reader_ring);
+	      ring_skip(&reader_ring); // staged character was used
+	      wait_for_no_request();
+	      stage_reader();
+	    }
+	  else if ( request_device == HIST_READER && replaying
+		    && replay_next(&ch) )
+	    put_pts_ch(ch); // held back by the gap recorded
+	  else
+	    {
+	      ring = request_device == HIST_TTY ? &keyboard_ring : &reader_ring;
+	      if ( ring_count(ring) == 0 )
+		{
+		  if ( ring == &reader_ring ) log_event(EV_READER_EMPTY, 0, 0);
+		  stall_set(FALSE, 0); // may wait for tape for ever
+		  while ( ring_count(ring) == 0 && !mount_pending )
+		    tight_loop_contents();
+		  if ( ring_count(ring) == 0 )
+		    continue; // request presented again after mount
+		  stall_set(TRUE, time_us_32());
+		}
+	      ch = ring_get(ring);
+	      put_pts_ch(ch);
+	    }
+	  if ( recording ) trace_add(ch);
+	  postmortem_add(ch);
+	  if ( cal_pending ) cal_step();
+	  if ( log_transfers ) log_event(EV_READ, ch, 0);
+	}
+      else
+	{
+	  ch = get_pts_ch();
+	  ring = request_device == HIST_TTY ? &printer_ring : &punch_ring;
+	  if ( ring_free(ring) == 0 )
+	    log_event(EV_PUNCH_FULL, ch, request_device);
+	  ring_put(ring, ch); // waits for room if full
+	  if ( recording ) trace_add(ch);
+	  postmortem_add(ch);
+	  if ( cal_pending ) cal_step();
+	  if ( log_transfers ) log_event(EV_PUNCH, ch, 0);
+	}
     }
 }
 
 
+/* core1's start up, which may call into flash.  Kept out of line */
+/* so that none of this is inlined into pts_emulation in SRAM.    */
+
+static void __noinline set_up_core1()
+{
+  set_up_dma();
+  set_up_idle();
+  set_up_pace();
+  stage_reader();
+  pio_sm_put(PTS_PIO, PUN_SM, PTS_PUNCH_GO); // first punch ACKs at once
+  punch_primed = TRUE;
+}
+
+
 /*  Output a character to paper tape station */ 
 /*  i.e., punch or tty output                */
 
-static inline void put_pts_ch(const uint32_t ch)
+static inline void __not_in_flash_func(put_pts_ch)(const uint32_t ch)
 {
-  gpio_put_masked(RDR_PINS_MASK, ch << RDR_1_PIN); // write 8 bits
-  ack();
+  pace_put(RDR_SM, ch); // state machine writes 8 bits and ACKs
   wait_for_no_request(); // wait for request to clear
+  stage_reader();
 }
 
 /* Input a character from the paper tape station */
 /* i.e., reader or tty input                     */
 
-static inline uint32_t get_pts_ch()
+static inline uint32_t __not_in_flash_func(get_pts_ch)()
 {
   uint32_t ch;
-  ch = (gpio_get_all() >> PUN_1_PIN) & 255; // read 8 bits
-  ack();
+  ch = request_word & 255; // 8 bits sampled by state machine
+  if ( punch_primed )
+    {
+      punch_primed = FALSE; // already ACKed
+      pace_last[request_device] = time_ack;
+    }
+  else
+    pace_put(PUN_SM, PTS_PUNCH_GO);
   wait_for_no_request();
+  if ( !pacing && !cal_pending )
+    {
+      pio_sm_put(PTS_PIO, PUN_SM, PTS_PUNCH_GO); // next one ACKs at once
+      punch_primed = TRUE;
+    }
   return(ch);
 }
 
@@ -407,21 +1747,58 @@ static inline uint32_t get_pts_ch()
 
 static inline void set_up_gpios()
 {
-  uint32_t in_pins_mask = 0, out_pins_mask = 0;
-  // calculate masks
-  for ( uint32_t i = 0; i < IN_PINS;  i++ ) in_pins_mask  |= (1 << in_pins[i]);
-  for ( uint32_t i = 0; i < OUT_PINS; i++ ) out_pins_mask |= (1 << out_pins[i]);
   // initialize GPIOs
-  gpio_init_mask(in_pins_mask | out_pins_mask);
+  gpio_init_mask(IN_PINS_MASK | OUT_PINS_MASK);
   // set up GPIO directions
-  gpio_set_dir_masked(in_pins_mask | out_pins_mask, out_pins_mask);
-  gpio_put_masked(out_pins_mask, 0); // initialize all GPIOs to LOW
+  gpio_set_dir_masked(IN_PINS_MASK | OUT_PINS_MASK, OUT_PINS_MASK);
+  gpio_put_masked(OUT_PINS_MASK, 0); // initialize all GPIOs to LOW
   // set NOPOWER high
   gpio_put(NOPOWER_PIN, 1);
   // set pull up on LOG_PIN
   gpio_pull_up(LOG_PIN);
 }
 
+/* start handshake state machines */
+
+static inline void set_up_pio()
+{
+  sys_mhz = clock_get_hz(clk_sys) / 1000000;
+  if ( config->magic == CONFIG_MAGIC )
+    {
+      ack_width(config->ack_ns);
+      poll_limit = config->timeout_us;
+    }
+  else
+    ack_width(ACK_US * 1000);
+  set_reader_program(&pts_reader_staged_program);
+  pun_offset = pio_add_program(PTS_PIO, &pts_punch_program);
+  pts_punch_program_init(PTS_PIO, PUN_SM, pun_offset,
+			 PUN_1_PIN, ACK_PIN, PUNREQ_PIN, ack_cycles);
+}
+
+/* Swap reader programs - only between transfers.  There is not */
+/* room in PIO instruction memory for both at once.  Runs from   */
+/* flash, so core1 calls it between flash_enter and flash_exit.  */
+
+static void __noinline set_reader_program(const pio_program_t *program)
+{
+  if ( rdr_program )
+    {
+      pio_sm_set_enabled(PTS_PIO, RDR_SM, FALSE);
+      pio_remove_program(PTS_PIO, rdr_program, rdr_offset);
+    }
+  rdr_program = program;
+  rdr_offset = pio_add_program(PTS_PIO, program);
+  if ( program == &pts_reader_staged_program )
+    pts_reader_staged_program_init(PTS_PIO, RDR_SM, rdr_offset,
+				   RDR_1_PIN, ACK_PIN, TTYSEL_PIN,
+				   RDRREQ_PIN, ack_cycles);
+  else
+    pts_reader_program_init(PTS_PIO, RDR_SM, rdr_offset,
+			    RDR_1_PIN, ACK_PIN, TTYSEL_PIN, RDRREQ_PIN,
+			    ack_cycles);
+}
+
 /* LED blinking */
 
 static inline void led_on()
@@ -452,52 +1829,3010 @@ static inline void set_power_off()
   gpio_put(NOPOWER_PIN, 1);
 }
 
-/* Acknowledge a transfer */
+/* Release NOPOWER once it has been high long enough and the request */
+/* lines are quiet, called from the core0 loop                      */
+
+static inline void power_poll()
+{
+  uint32_t now = time_us_32();
+  if ( powered ) return;
+  if ( gpio_get(RDRREQ_PIN) || gpio_get(PUNREQ_PIN) ) power_quiet = now;
+  if ( now - power_start < RESET_MIN_US
+       || ( now - power_quiet < RESET_QUIET_US
+	    && now - power_start < RESET_MAX_US ) )
+    return;
+  set_power_on();
+  powered = TRUE;
+  if ( logging_enabled )
+    printf("920M reset released after %u mS\n", (now - power_start) / 1000);
+}
+
+/* Say what state the station is in whenever a host connects to the */
+/* serial port, as it may well have missed the start                */
 
-static inline uint32_t ack()
+static inline void connect_poll()
 {
-  gpio_put(ACK_PIN, 1);
-  busy_wait_us_32(4);
-  gpio_put(ACK_PIN, 0);
+  static uint32_t connected = FALSE;
+  if ( connected == tud_cdc_connected() ) return;
+  connected = !connected;
+  if ( connected && logging_enabled )
+    {
+      printf("\n\n\nPicoPTS running, 920M %s, up %u secs\n",
+	     powered ? "released" : "held in reset", time_us_32() / 1000000);
+      if ( postmortem_found ) postmortem_print();
+    }
 }
 
 /* Wait for transfer request */
 
-static inline uint32_t wait_for_request()
+static inline uint32_t __not_in_flash_func(wait_for_request)()
+{
+  uint32_t idle_start = time_us_32(), edge = FALSE, edge_time;
+  while ( TRUE )
+    {
+      if ( counts_reset ) counts_clear();
+      if ( woken && ( !pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM) ||
+		      !pio_sm_is_rx_fifo_empty(PTS_PIO, PUN_SM) ) )
+	{
+	  uint32_t latency = time_us_32() - wake_time;
+	  edge = TRUE; // the interrupt timed the request edge
+	  edge_time = wake_time;
+	  woken = FALSE;
+	  wake_count++;
+	  wake_sum += latency;
+	  if ( latency > wake_max ) wake_max = latency;
+	}
+      if ( mount_pending && pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM)
+	   && flash_enter() )
+	{ // reload reader program to drop any staged character and
+	  // present again any read left waiting
+	  if ( mount_flush ) reader_ring.tail = reader_ring.head;
+	  stream_paused = FALSE; // held stream's tape goes too
+	  if ( reader_streaming )
+	    reader_stream_stop();
+	  else
+	    {
+	      set_reader_program(&pts_reader_staged_program);
+	      stage_reader();
+	    }
+	  if ( mount_tape ) reader_stream_start(mount_tape, mount_length);
+	  mount_pending = FALSE;
+	  flash_exit();
+	}
+      if ( stream_paused && !mount_pending && !gpio_get(RDRREQ_PIN)
+	   && pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM) && flash_enter() )
+	{ // teleprinter read cleared, back to the tape
+	  reader_stream_start(stream_resume, stream_left);
+	  stream_paused = FALSE;
+	  flash_exit();
+	}
+      if ( bench_pending && !benchmarking && !mount_pending
+	   && pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM)
+	   && pio_sm_is_rx_fifo_empty(PTS_PIO, PUN_SM) )
+	return BENCH;
+      if ( reader_streaming )
+	reader_stream_poll();
+      else if ( !pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM) )
+	{
+	  time_seen = edge ? edge_time : time_us_32();
+	  time_ack = time_seen; // staged read ACKs at once
+	  request_sm = RDR_SM;
+	  request_word = pio_sm_get(PTS_PIO, RDR_SM);
+	  if ( stale[RDR_SM] && (request_word & PTS_PIO_DONE) )
+	    {
+	      stale[RDR_SM]--; // abandoned transfer has cleared
+	      edge = FALSE;
+	      continue;
+	    }
+	  request_device = ( request_word != PTS_PIO_STAGED
+			     && (request_word & 1) ) ? HIST_TTY : HIST_READER;
+	  stall_set(TRUE, time_seen);
+	  return READ;
+	}
+      if ( !pio_sm_is_rx_fifo_empty(PTS_PIO, PUN_SM) )
+	{
+	  time_seen = edge ? edge_time : time_us_32();
+	  time_ack = time_seen; // primed punch ACKs at once
+	  request_sm = PUN_SM;
+	  request_word = pio_sm_get(PTS_PIO, PUN_SM);
+	  if ( stale[PUN_SM] && (request_word & PTS_PIO_DONE) )
+	    {
+	      stale[PUN_SM]--;
+	      edge = FALSE;
+	      continue;
+	    }
+	  request_device = ( (request_word >> TTYSEL_SHIFT) & 1 )
+	    ? HIST_TTY : HIST_PUNCH;
+	  stall_set(TRUE, time_seen);
+	  return PUNCH;
+	}
+      if ( !reader_streaming && time_us_32() - idle_start > IDLE_SPIN_US )
+	{
+	  idle_wait();
+	  idle_start = time_us_32(); // poll again after any wake up
+	}
+    }
+}
+
+/* Request edge interrupt on core1, only enabled while idle */
+
+static void __not_in_flash_func(idle_irq)()
+{
+  wake_time = time_us_32();
+  woken = TRUE;
+  request_edges(FALSE);
+}
+
+static inline void set_up_idle()
+{
+  irq_set_exclusive_handler(IO_IRQ_BANK0, idle_irq);
+  irq_set_enabled(IO_IRQ_BANK0, TRUE); // on core1, which calls this
+}
+
+/* Sleep until an interrupt or event.  A request already seen by */
+/* the PIO, or whose edge arrives before the WFE, is not missed: */
+/* the FIFOs are checked after arming and taking the interrupt   */
+/* sets the event register.  Any wake up returns to polling.     */
+
+static inline void __not_in_flash_func(idle_wait)()
+{
+  woken = FALSE;
+  request_edges(TRUE);
+  if ( pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM) &&
+       pio_sm_is_rx_fifo_empty(PTS_PIO, PUN_SM) )
+    __wfe();
+  request_edges(FALSE);
+}
+
+/* Clear any request edge seen and enable or disable the interrupt */
+/* for core1.  The registers are used directly as the SDK's gpio   */
+/* functions run from flash.                                       */
+
+#define EDGE_BIT(pin) (GPIO_IRQ_EDGE_RISE << 4 * ((pin) % 8))
+
+static inline void __not_in_flash_func(request_edges)(uint32_t enable)
+{
+  io_rw_32 *rdr = &iobank0_hw->proc1_irq_ctrl.inte[RDRREQ_PIN / 8];
+  io_rw_32 *pun = &iobank0_hw->proc1_irq_ctrl.inte[PUNREQ_PIN / 8];
+  iobank0_hw->intr[RDRREQ_PIN / 8] = EDGE_BIT(RDRREQ_PIN); // acknowledge
+  iobank0_hw->intr[PUNREQ_PIN / 8] = EDGE_BIT(PUNREQ_PIN);
+  if ( enable )
+    {
+      hw_set_bits(rdr, EDGE_BIT(RDRREQ_PIN));
+      hw_set_bits(pun, EDGE_BIT(PUNREQ_PIN));
+    }
+  else
+    {
+      hw_clear_bits(rdr, EDGE_BIT(RDRREQ_PIN));
+      hw_clear_bits(pun, EDGE_BIT(PUNREQ_PIN));
+    }
+}
+
+/* core1 cannot longjmp to main, which runs on core0's stack, so   */
+/* it leaves its fail code for core0 to halt with and stops dead.  */
+
+static void __not_in_flash_func(core1_fail)(uint32_t code)
 {
-  uint32_t pins;
-  while ( !((pins = gpio_get_all()) &
-	   (read_request_bit | punch_request_bit)) )
-    busy_wait_us_32(1);
-  if ( (pins & read_request_bit) )
-    return READ;
-  else if ( (pins & punch_request_bit)  )
-    return PUNCH;
+  save_and_disable_interrupts(); // nothing more from the handlers
+  stall_set(FALSE, 0); // not a stall, core0 halts instead
+  core1_failed = code;
+  __sev(); // core0 may be waiting for an event
+  while ( TRUE ) __wfe();
 }
 
-/* Wait for request to clear */
+/* Wait for request to clear.  If it does not by POLL_LIMIT the     */
+/* device's error policy is followed.  Returns FALSE if the transfer */
+/* was abandoned or its state machine restarted, so the computer    */
+/* may not have seen it through, TRUE if all is well.  Either way  */
+/* the character counts as transferred.                            */
 
-static inline void wait_for_no_request()
+static inline uint32_t __not_in_flash_func(wait_for_no_request)()
 {
-  uint32_t count = 0, pins;
-  while ( ((pins = gpio_get_all())
-	   & (read_request_bit | punch_request_bit)) )
+  uint32_t start = time_us_32(), count, done, retries = 0, ok = TRUE;
+  while ( ok && pio_sm_is_rx_fifo_empty(PTS_PIO, request_sm) )
     {
-      if ( count++ > max_poll ) max_poll = count;
-      if ( count > POLL_LIMIT )
-        {
-	  if ( logging_enabled )
+      count = time_us_32() - start;
+      if ( cal_active && cal_phase != CAL_RELEASE && !cal_missed
+	   && count > cal_limit )
+	cal_reack(); // ACK too short for the computer
+      if ( count > poll_limit )
+	{
+	  log_event(EV_TIMEOUT, 0, count);
+	  err_timeouts++;
+	  switch ( error_policy[request_device] )
 	    {
-	      printf("Time out waiting for %s%s request to clear "
-		     "at cycle %"PRIu64" after polling %u times\n",
-		     ( (pins & read_request_bit)  ) ? "RDRREQ" : "",
-		     ( (pins & punch_request_bit) ) ? "PUNREQ" : "",
-		     cycles, --count);
+	    case ERR_RETRY:
+	      if ( retries++ < ERR_RETRIES )
+		{
+		  err_retries++;
+		  start = time_us_32();
+		  break;
+		}
+	      /* FALL THROUGH */
+	    case ERR_RESYNC:
+	      request_resync();
+	      ok = FALSE;
+	      break;
+	    case ERR_SKIP:
+	      stale[request_sm]++; // PTS_PIO_DONE still to come
+	      err_skips++;
+	      ok = FALSE;
+	      break;
+	    default:
+	      core1_fail(REQUEST_END_FAIL);
+	      /* NOT REACHED */
 	    }
-	    longjmp(jbuf, REQUEST_END_FAIL);
-	    /* NOT REACHED */
-        }
-      busy_wait_us_32(1);
+	}
+    }
+  if ( ok ) done = pio_sm_get(PTS_PIO, request_sm);
+  chars[request_sm == RDR_SM ? DIR_IN : DIR_OUT]++;
+  time_req_ack = time_ack - time_seen;
+  time_ack_clear = ok ? PTS_PIO_CLEAR_CYCLES(done) / sys_mhz // as counted
+    : time_us_32() - start; // given up on, at least as long as waited
+  hist_add(HIST_REQ_ACK, time_req_ack);
+  hist_add(HIST_ACK_CLEAR, time_ack_clear);
+  stall_set(FALSE, 0); // handshake over
+  return ok;
+}
+
+/* Wait, however long it takes, for the request to drop, then start */
+/* its state machine again from idle with empty FIFOs, so whatever  */
+/* it was doing is forgotten and the next request edge finds it     */
+/* ready.  The staged reader starts by taking a staging word, and   */
+/* the punch go ahead queued is lost, so callers carry on as after  */
+/* any other transfer.                                              */
+
+static inline void __not_in_flash_func(request_resync)()
+{
+  uint32_t pin = request_sm == RDR_SM ? RDRREQ_PIN : PUNREQ_PIN;
+  stall_set(FALSE, 0); // however long it takes
+  while ( gpio_get(pin) ) tight_loop_contents();
+  stall_set(TRUE, time_us_32());
+  restart_sm(request_sm);
+  err_resyncs++;
+}
+
+/* Start state machine sm again from idle with empty FIFOs and the */
+/* current ACK width                                               */
+
+static inline void __not_in_flash_func(restart_sm)(uint32_t sm)
+{
+  uint32_t pc;
+  if ( sm == PUN_SM )
+    {
+      pc = pun_offset + pts_punch_offset_idle;
+      punch_primed = FALSE;
+    }
+  else if ( rdr_program == &pts_reader_staged_program )
+    pc = rdr_offset;
+  else
+    pc = rdr_offset + pts_reader_offset_idle;
+  sm_set_enabled(sm, FALSE);
+  pio_sm_clear_fifos(PTS_PIO, sm);
+  pio_sm_restart(PTS_PIO, sm);
+  pts_load_ack_width(PTS_PIO, sm, ack_cycles);
+  pio_sm_exec(PTS_PIO, sm, pio_encode_jmp(pc));
+  sm_set_enabled(sm, TRUE);
+  stale[sm] = 0;
+}
+
+/* Start or stop state machine sm without touching the others, */
+/* which core0 may be holding for a flash write meanwhile       */
+
+static inline void __not_in_flash_func(sm_set_enabled)(uint32_t sm,
+						       uint32_t on)
+{
+  if ( on )
+    hw_set_bits(&PTS_PIO->ctrl, 1u << sm);
+  else
+    hw_clear_bits(&PTS_PIO->ctrl, 1u << sm);
+}
+
+/* Set the ACK pulse width, for state machines started from now on */
+
+static inline void __not_in_flash_func(ack_width)(uint32_t ns)
+{
+  ack_ns = ns;
+  ack_cycles = ns * sys_mhz / 1000 - 2;
+}
+
+/* Count a latency for the current transfer */
+
+static inline void __not_in_flash_func(hist_add)(uint32_t kind, uint32_t us)
+{
+  uint32_t bucket = us ? 32 - __builtin_clz(us) : 0;
+  if ( bucket >= HIST_BUCKETS ) bucket = HIST_BUCKETS - 1;
+  hist[request_device][kind][bucket]++;
+}
+
+/* Reset the counts core1 keeps, when core0 asks */
+
+static void __not_in_flash_func(counts_clear)()
+{
+  for ( uint32_t d = 0 ; d < HIST_DEVICES ; d++ )
+    for ( uint32_t k = 0 ; k < 2 ; k++ )
+      for ( uint32_t b = 0 ; b < HIST_BUCKETS ; b++ )
+	hist[d][k][b] = 0;
+  wake_count = wake_max = wake_sum = 0;
+  err_timeouts = err_retries = err_skips = err_resyncs = 0;
+  __dmb(); // clear before saying so
+  counts_reset = FALSE;
+}
+
+/* After a reader transfer give the staged reader state machine     */
+/* the next tape character, if there is one, to put on the RDR pins. */
+/* It is only taken from the ring once PTS_PIO_STAGED says the      */
+/* computer has read it.  Nothing is staged while pacing,          */
+/* calibrating, replaying or benchmarking.                          */
+
+static inline void __not_in_flash_func(stage_reader)()
+{
+  pio_sm_put(PTS_PIO, RDR_SM, !pacing && !cal_pending && !replaying
+	     && !bench_pending && ring_count(&reader_ring)
+	     ? ring_peek(&reader_ring) : PTS_STAGE_NONE);
+}
+
+
+/**********************************************************/
+/*                         PACING                         */
+/**********************************************************/
+
+
+/* Put the held back word when the pacing alarm fires */
+
+static void __not_in_flash_func(pace_irq)()
+{
+  pio_sm_put(PTS_PIO, pace_sm, pace_word);
+  pace_time = time_us_32();
+  timer_hw->intr = 1u << PACE_ALARM; // clear interrupt
+  pace_waiting = FALSE;
+  __sev();
+}
+
+/* The pacing alarm interrupts core1, which calls this */
+
+static inline void set_up_pace()
+{
+  hardware_alarm_claim(PACE_ALARM);
+  irq_set_exclusive_handler(TIMER_IRQ_0 + PACE_ALARM, pace_irq);
+  hw_set_bits(&timer_hw->inte, 1u << PACE_ALARM);
+  irq_set_enabled(TIMER_IRQ_0 + PACE_ALARM, TRUE);
+}
+
+/* Put word to state machine sm, which then ACKs, no sooner than   */
+/* the device's character time, or when replaying the reader the  */
+/* gap recorded, after its last ACK.  If that is                  */
+/* still to come the alarm puts it, so the ACK is on time whatever */
+/* else core1 might be doing, and core1 sleeps until then.        */
+
+static inline void __not_in_flash_func(pace_put)(uint32_t sm, uint32_t word)
+{
+  uint32_t replay = replaying && request_device == HIST_READER;
+  uint32_t due = pace_last[request_device]
+    + (replay ? replay_gap : pace_period[request_device]);
+  uint32_t status = save_and_disable_interrupts(); // so alarm not missed
+  if ( (pacing || replay) && (int32_t) (due - time_us_32()) > PACE_MARGIN_US )
+    {
+      pace_sm = sm;
+      pace_word = word;
+      pace_waiting = TRUE;
+      timer_hw->alarm[PACE_ALARM] = due; // arms the alarm
+      restore_interrupts(status);
+      stall_set(TRUE, due); // late only if the alarm is
+      while ( pace_waiting ) __wfe();
+      time_ack = pace_time;
+    }
+  else
+    {
+      time_ack = time_us_32();
+      pio_sm_put(PTS_PIO, sm, word);
+      restore_interrupts(status);
+    }
+  pace_last[request_device] = time_ack;
+}
+
+
+
+/**********************************************************/
+/*                     TRANSFER TRACE                     */
+/**********************************************************/
+
+
+/* Record the transfer just made, stopping when the trace is full */
+
+static inline void __not_in_flash_func(trace_add)(uint32_t ch)
+{
+  uint32_t n = trace_count;
+  if ( n == TRACE_ENTRIES )
+    {
+      recording = FALSE;
+      return;
+    }
+  trace[n].time = time_seen;
+  trace[n].ch = ch;
+  trace[n].device = request_device;
+  trace[n].req_ack = MIN(time_req_ack, 255);
+  trace[n].ack_clear = MIN(time_ack_clear, 255);
+  __dmb(); // publish entry before count
+  trace_count = n + 1;
+}
+
+/* Next reader character of the trace being replayed, and the gap */
+/* between the ACKs of it and the one before when recorded.      */
+/* Returns FALSE, and stops replaying, when there are no more.   */
+
+static inline uint32_t __not_in_flash_func(replay_next)(uint32_t *ch)
+{
+  uint32_t ack;
+  while ( replay_pos < trace_count && trace[replay_pos].device != HIST_READER )
+    replay_pos++;
+  if ( replay_pos == trace_count )
+    {
+      replaying = FALSE;
+      return FALSE;
+    }
+  ack = trace[replay_pos].time + trace[replay_pos].req_ack;
+  replay_gap = replay_started ? ack - replay_ack : 0; // first at once
+  replay_ack = ack;
+  replay_started = TRUE;
+  *ch = trace[replay_pos++].ch;
+  return TRUE;
+}
+
+
+/**********************************************************/
+/*                       CALIBRATION                      */
+/**********************************************************/
+
+
+/* Called by core1 after each transfer it makes while calibrating. */
+/* ACK widths are only changed between transfers with both state   */
+/* machines idle, so a step may wait for a pause.  Before anything */
+/* is measured both are started again to drop any character staged */
+/* or punch primed beforehand, which would be ACKed as soon as it  */
+/* was asked for, and neither is done again until calibrated.      */
+
+static void __not_in_flash_func(cal_step)()
+{
+  if ( reader_streaming ) return; // state machine busy with DMA
+  if ( !cal_active )
+    {
+      cal_phase = CAL_RELEASE;
+      cal_count = cal_release = 0;
+      cal_good = cal_want = ack_ns;
+      cal_missed = cal_unstaged = FALSE;
+      cal_active = TRUE;
+      return;
+    }
+  if ( cal_want != ack_ns || !cal_unstaged )
+    {
+      if ( cal_apply() && cal_phase == CAL_DONE ) cal_finish();
+      return; // count from the next transfer
+    }
+  if ( cal_missed )
+    {
+      cal_settle();
+      return;
+    }
+  if ( time_ack_clear > cal_release ) cal_release = time_ack_clear;
+  if ( ++cal_count < CAL_TRANSFERS ) return;
+  cal_count = 0;
+  if ( cal_phase == CAL_ACK ) cal_good = ack_ns; // this width worked
+  cal_phase = CAL_ACK;
+  cal_limit = 2 * cal_release + CAL_MISS_US;
+  if ( ack_ns <= CAL_MIN_NS )
+    cal_settle();
+  else
+    cal_want = ack_ns - CAL_STEP_NS;
+}
+
+/* Choose the ACK width and timeout, the shortest ACK that worked   */
+/* and the longest release each with the margin added, to be set by */
+/* cal_step once the state machines are idle                       */
+
+static inline void __not_in_flash_func(cal_settle)()
+{
+  cal_result.magic = CONFIG_MAGIC;
+  cal_result.release_us = cal_release;
+  cal_result.min_ack_ns = cal_good;
+  cal_result.ack_ns = cal_good * (100 + cal_result.margin) / 100;
+  cal_result.timeout_us = MAX(cal_release * (100 + cal_result.margin) / 100,
+			      CAL_TIMEOUT_MIN);
+  poll_limit = cal_result.timeout_us;
+  cal_phase = CAL_DONE;
+  cal_want = cal_result.ack_ns;
+  if ( cal_want == ack_ns ) cal_finish(); // nothing to change
+}
+
+/* Hand the results to core0 */
+
+static inline void __not_in_flash_func(cal_finish)()
+{
+  cal_active = FALSE;
+  __dmb(); // publish results before finishing
+  cal_pending = FALSE;
+}
+
+/* Start both state machines again with an ACK of cal_want, if     */
+/* neither is in the middle of a transfer.  Returns TRUE if done.  */
+
+static inline uint32_t __not_in_flash_func(cal_apply)()
+{
+  if ( gpio_get(RDRREQ_PIN) || gpio_get(PUNREQ_PIN)
+       || !pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM)
+       || !pio_sm_is_rx_fifo_empty(PTS_PIO, PUN_SM) )
+    return FALSE;
+  ack_width(cal_want);
+  cal_want = ack_ns;
+  restart_sm(RDR_SM);
+  restart_sm(PUN_SM);
+  cal_unstaged = TRUE;
+  stage_reader(); // nothing, nor the punch primed, until calibrated
+  return TRUE;
+}
+
+/* The computer has not dropped the request, presumably having     */
+/* missed an ACK too short for it, so pulse ACK again at the last  */
+/* width that worked.  The state machine, which is waiting for the */
+/* request to drop, is stopped meanwhile.                          */
+
+static inline void __not_in_flash_func(cal_reack)()
+{
+  uint32_t start;
+  sm_set_enabled(request_sm, FALSE);
+  pio_sm_exec(PTS_PIO, request_sm,
+	      pio_encode_nop() | pio_encode_sideset_opt(1, 1)); // ACK high
+  start = time_us_32();
+  while ( time_us_32() - start < (cal_good + 999) / 1000 + 1 )
+    tight_loop_contents();
+  pio_sm_exec(PTS_PIO, request_sm,
+	      pio_encode_nop() | pio_encode_sideset_opt(1, 0)); // and low
+  sm_set_enabled(request_sm, TRUE);
+  cal_missed = TRUE;
+}
+
+
+/**********************************************************/
+/*                        WATCHDOG                        */
+/**********************************************************/
+
+
+/* Keep any post-mortem left by a watchdog reset, start a new one */
+/* and start the watchdog.  Called before core1 is launched.      */
+
+static void set_up_watchdog()
+{
+  uint32_t resets = 0;
+  if ( watchdog_caused_reboot() && postmortem.magic == POSTMORTEM_MAGIC )
+    {
+      postmortem_last = postmortem;
+      postmortem_found = TRUE;
+      resets = postmortem.resets + 1;
+    }
+  memset(&postmortem, 0, sizeof(postmortem));
+  postmortem.magic = POSTMORTEM_MAGIC;
+  postmortem.resets = resets;
+  postmortem_save(PM_WATCHDOG);
+  watchdog_enable(WATCHDOG_MS, TRUE); // paused while debugging
+}
+
+/* Feed the watchdog, from the core0 loop and while waiting on     */
+/* USB, unless core1 is overdue in a handshake.  Then the          */
+/* post-mortem is saved and the watchdog is left to reset the      */
+/* station.  core1 sets core1_due before core1_busy and leaves it  */
+/* alone when not busy, so reading them in the other order never   */
+/* sees an old time with a new handshake.                          */
+
+static inline void watchdog_poll()
+{
+  uint32_t now = time_us_32(), busy;
+  if ( stalled || !monitoring ) return;
+  busy = core1_busy;
+  __dmb();
+  if ( busy && (int32_t) (now - core1_due) > 0 )
+    {
+      stalled = TRUE;
+      postmortem_save(PM_STALL);
+      if ( logging_enabled )
+	printf("core1 stalled in %s handshake, restarting\n",
+	       hist_names[request_device]);
+      return;
+    }
+  watchdog_update();
+}
+
+/* core1: say whether in a handshake, which should be over STALL_US */
+/* after due, or waiting for something that may take for ever       */
+
+static inline void __not_in_flash_func(stall_set)(uint32_t busy, uint32_t due)
+{
+  if ( busy )
+    {
+      core1_due = due + STALL_US;
+      __dmb(); // publish time before busy
+    }
+  core1_busy = busy;
+}
+
+/* core1: add the transfer just made to the post-mortem trace */
+
+static inline void __not_in_flash_func(postmortem_add)(uint32_t ch)
+{
+  trace_t *t = &postmortem.trace[postmortem.trace_next++
+				 & (POSTMORTEM_TRACE - 1)];
+  t->time = time_seen;
+  t->ch = ch;
+  t->device = request_device;
+  t->req_ack = MIN(time_req_ack, 255);
+  t->ack_clear = MIN(time_ack_clear, 255);
+}
+
+/* Copy what core0 can see of core1 into the post-mortem, in case */
+/* the watchdog fires for the reason given before the next copy.  */
+
+static void postmortem_save(uint32_t cause)
+{
+  uint32_t now = time_us_32();
+  postmortem.cause = cause;
+  postmortem.uptime = now / 1000000;
+  postmortem.busy = core1_busy;
+  postmortem.device = request_device;
+  postmortem.word = request_word;
+  postmortem.since = now - time_seen;
+  postmortem.chars[DIR_IN] = chars[DIR_IN];
+  postmortem.chars[DIR_OUT] = chars[DIR_OUT];
+  postmortem.errors[0] = err_timeouts;
+  postmortem.errors[1] = err_retries;
+  postmortem.errors[2] = err_skips;
+  postmortem.errors[3] = err_resyncs;
+  postmortem.events_dropped = events_dropped;
+  memcpy(postmortem.hist, hist, sizeof(hist));
+}
+
+/* Report the post-mortem found at start up, last transfers first */
+
+static void postmortem_print()
+{
+  postmortem_t *p = &postmortem_last;
+  uint32_t n = MIN(p->trace_next, POSTMORTEM_TRACE);
+  printf("Restarted by watchdog (%u since power on) after %u secs: %s\n",
+	 p->resets, p->uptime,
+	 p->cause == PM_STALL ? "core1 stalled" : "core0 stopped");
+  if ( p->busy )
+    printf("core1 in %s handshake for %u uS, request word %08x\n",
+	   hist_names[p->device % HIST_DEVICES], p->since, p->word);
+  printf("Characters in %u out %u, timeouts %u retries %u skips %u"
+	 " resyncs %u, %u events dropped\n", p->chars[DIR_IN],
+	 p->chars[DIR_OUT], p->errors[0], p->errors[1], p->errors[2],
+	 p->errors[3], p->events_dropped);
+  hist_print(p->hist);
+  for ( uint32_t i = 1 ; i <= n ; i++ )
+    {
+      trace_t *t = &p->trace[(p->trace_next - i) & (POSTMORTEM_TRACE - 1)];
+      printf("LAST %10u %-6s %03o req-ack %u ack-clear %u\n", t->time,
+	     hist_names[t->device % HIST_DEVICES], t->ch, t->req_ack,
+	     t->ack_clear);
+    }
+}
+
+
+#if PTS_LOOPBACK
+
+/**********************************************************/
+/*                        LOOPBACK                        */
+/**********************************************************/
+
+
+/* Load the computer side, requests low until a benchmark starts */
+
+static void set_up_loopback()
+{
+  loop_offset = pio_add_program(LOOP_PIO, &pts_computer_program);
+  pts_computer_program_init(LOOP_PIO, LOOP_SM, loop_offset, PUN_1_PIN,
+			    TTYSEL_PIN, PUNREQ_PIN, RDR_1_PIN, ACK_PIN);
+}
+
+/* Play workload b, the benchmark about to be run by core1 or the */
+/* reads and punches of H_LOOP, starting afresh in case the last   */
+/* one was cut short with a request still raised.                 */
+
+static void loopback_start(const bench_t *b, uint32_t gap_us)
+{
+  pio_sm_set_enabled(LOOP_PIO, LOOP_SM, FALSE);
+  pio_sm_clear_fifos(LOOP_PIO, LOOP_SM);
+  pio_sm_restart(LOOP_PIO, LOOP_SM);
+  pio_sm_set_pins_with_mask(LOOP_PIO, LOOP_SM, 0, 3u << PUNREQ_PIN);
+  pio_sm_exec(LOOP_PIO, LOOP_SM, pio_encode_jmp(loop_offset));
+  pio_sm_set_enabled(LOOP_PIO, LOOP_SM, TRUE);
+  loop_bench = *b;
+  loop_bench.state = loop_bench.seed;
+  loop_bench.count = loop_bench.last = 0;
+  loop_gap = gap_us * (clock_get_hz(clk_sys) / 1000000);
+  loop_head = loop_tail = loop_errors = 0;
+  loop_service = FALSE;
+  loop_active = TRUE;
+}
+
+/* Check characters read and keep the state machine's FIFO topped */
+/* up, two words to each transfer.  Called from the core0 loop.    */
+
+static inline void loopback_poll()
+{
+  uint32_t dir, tty, ch;
+  if ( !loop_active ) return;
+  while ( !pio_sm_is_rx_fifo_empty(LOOP_PIO, LOOP_SM) )
+    if ( (pio_sm_get(LOOP_PIO, LOOP_SM) & 255)
+	 != loop_expect[loop_tail++ & (LOOP_EXPECT - 1)] )
+      loop_errors++;
+  while ( loop_bench.count < loop_bench.length
+	  && pio_sm_get_tx_fifo_level(LOOP_PIO, LOOP_SM) <= 2
+	  && loop_head - loop_tail < LOOP_EXPECT )
+    {
+      dir = bench_next(&loop_bench, &tty, &ch);
+      if ( dir == READ ) loop_expect[loop_head++ & (LOOP_EXPECT - 1)] = ch;
+      pio_sm_put(LOOP_PIO, LOOP_SM, loop_gap);
+      pio_sm_put(LOOP_PIO, LOOP_SM, ch | (tty ? 1u << TTYSEL_SHIFT : 0)
+		 | (dir == PUNCH ? PTS_LOOP_PUNCH : 0));
+    }
+  if ( loop_bench.count == loop_bench.length && loop_head == loop_tail
+       && pio_sm_is_tx_fifo_empty(LOOP_PIO, LOOP_SM)
+       && pio_sm_get_pc(LOOP_PIO, LOOP_SM) == loop_offset )
+    loop_active = FALSE; // and the last punch made
+}
+
+/* H_LOOP: pattern, characters and optionally seed and gap has the */
+/* computer side read that many characters of the tape the host    */
+/* streams, checking them against the pattern, and punch each one  */
+/* back, all by normal service.  Any tape being read is taken away */
+/* first.  With no payload reports the last run.                   */
+
+static void loop_command()
+{
+  bench_t b;
+  uint32_t n;
+  if ( host_cmd_len == 0 )
+    {
+      if ( !loop_service )
+	puts("ERROR no loopback run");
+      else if ( loop_active )
+	puts("ERROR loopback running");
+      else
+	loop_print("OK");
+      return;
+    }
+  if ( bench_started || mount_pending )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  if ( host_cmd_len < 5 || host_cmd[0] > BENCH_ONES )
+    {
+      puts("ERROR no such pattern");
+      return;
+    }
+  n = host_cmd[1] | (host_cmd[2] << 8) | (host_cmd[3] << 16)
+    | (host_cmd[4] << 24);
+  b.workload = BENCH_ALTERNATE; // read, then punch it back
+  b.pattern = host_cmd[0];
+  b.length = 2 * n;
+  b.seed = host_cmd_len < 9 ? BENCH_SEED : host_cmd[5] | (host_cmd[6] << 8)
+    | (host_cmd[7] << 16) | (host_cmd[8] << 24);
+  if ( b.seed == 0 ) b.seed = BENCH_SEED;
+  mounted = LIBRARY_TAPES;
+  tape_start(NULL, NULL, TRUE); // the host's tape comes next
+  loopback_start(&b, host_cmd_len < 13 ? 0 : host_cmd[9]
+		 | (host_cmd[10] << 8) | (host_cmd[11] << 16)
+		 | (host_cmd[12] << 24));
+  loop_service = TRUE;
+  printf("OK loopback %s %u seed %u\n", bench_patterns[b.pattern], n,
+	 b.seed);
+}
+
+/* Results of H_LOOP as name=value pairs */
+
+static void loop_print(const char *prefix)
+{
+  printf("%s pattern=%s length=%u seed=%u read=%u punched=%u errors=%u\n",
+	 prefix, bench_patterns[loop_bench.pattern], loop_bench.length / 2,
+	 loop_bench.seed, loop_tail, loop_bench.count - loop_head,
+	 loop_errors);
+}
+
+#endif
+
+
+/**********************************************************/
+/*                    DMA READER STREAM                   */
+/**********************************************************/
+
+
+/* Two DMA channels chained to each other feed the reader state */
+/* machine's TX FIFO a block at a time.  When one finishes the  */
+/* other takes over and the DMA_IRQ_1 handler on core1 queues   */
+/* the next block on the idle channel.                          */
+
+static void reader_dma_irq();
+
+static inline void set_up_dma()
+{
+  for ( uint32_t i = 0 ; i < 2 ; i++ )
+    dma_chan[i] = dma_claim_unused_channel(true);
+  for ( uint32_t i = 0 ; i < 2 ; i++ )
+    {
+      dma_channel_config c = dma_channel_get_default_config(dma_chan[i]);
+      channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+      channel_config_set_read_increment(&c, true);
+      channel_config_set_write_increment(&c, false);
+      channel_config_set_dreq(&c, pio_get_dreq(PTS_PIO, RDR_SM, true));
+      channel_config_set_chain_to(&c, dma_chan[i^1]);
+      dma_config[i] = c;
+      dma_channel_set_irq1_enabled(dma_chan[i], true);
+    }
+  irq_set_exclusive_handler(DMA_IRQ_1, reader_dma_irq);
+  irq_set_enabled(DMA_IRQ_1, TRUE); // on core1, which calls this
+}
+
+/* Queue the next block on channel i, FALSE if tape exhausted */
+
+static inline uint32_t __not_in_flash_func(reader_dma_queue)(uint32_t i,
+							     uint32_t trigger)
+{
+  uint32_t count = dma_end - dma_next;
+  if ( count == 0 ) return FALSE;
+  if ( count > DMA_BLOCK ) count = DMA_BLOCK;
+  dma_channel_configure(dma_chan[i], &dma_config[i],
+			&PTS_PIO->txf[RDR_SM], dma_next, count, trigger);
+  dma_next += count;
+  dma_queued++;
+  return TRUE;
+}
+
+/* Stop channel i chaining to the other one */
+
+static inline void __not_in_flash_func(reader_dma_unchain)(uint32_t i)
+{
+  channel_config_set_chain_to(&dma_config[i], dma_chan[i]);
+  dma_channel_set_config(dma_chan[i], &dma_config[i], FALSE);
+}
+
+/* A block has gone: refill its channel, which the other one */
+/* will trigger when it finishes.  Blocks are long enough    */
+/* that this always happens well before then.                */
+
+static void __not_in_flash_func(reader_dma_irq)()
+{
+  for ( uint32_t i = 0 ; i < 2 ; i++ )
+    if ( dma_hw->ints1 & (1u << dma_chan[i]) )
+      {
+	dma_hw->ints1 = 1u << dma_chan[i]; // clear interrupt
+	dma_queued--;
+	if ( !reader_dma_queue(i, FALSE) )
+	  reader_dma_unchain(i^1); // last block running or done
+      }
+}
+
+/* Start streaming a tape image to the reader.  Loads a PIO program */
+/* so runs from flash, between flash_enter and flash_exit.          */
+
+static void __noinline reader_stream_start(const uint8_t *tape,
+					    uint32_t length)
+{
+  if ( length == 0 ) return;
+  for ( uint32_t i = 0 ; i < 2 ; i++ )
+    {
+      channel_config_set_chain_to(&dma_config[i], dma_chan[i^1]);
+      dma_hw->ints1 = 1u << dma_chan[i];
+    }
+  dma_next = tape;
+  dma_end  = tape + length;
+  dma_queued = 0;
+  stream_last = PTS_PIO_DONE;
+  reader_streaming = TRUE;
+  set_reader_program(&pts_reader_program); // discards any staged char
+  log_event(EV_STREAM_START, 0, length);
+  reader_dma_queue(0, FALSE);          // first block
+  if ( !reader_dma_queue(1, FALSE) )   // second, chained from first
+    reader_dma_unchain(0);
+  dma_channel_start(dma_chan[0]);
+}
+
+/* Called from wait_for_request while streaming.  Consumes the   */
+/* reader state machine's request words and, once the stream is  */
+/* exhausted and the reader is either idle or waiting for a      */
+/* character, goes back to the staged reader, which will see any */
+/* request still outstanding and pass it to core1.  The same     */
+/* goes for a teleprinter read, which waits at tty, except that  */
+/* the rest of the tape is kept for wait_for_request to stream   */
+/* once the read has cleared.                                    */
+
+static inline void __not_in_flash_func(reader_stream_poll)()
+{
+  const uint8_t *next;
+  while ( !pio_sm_is_rx_fifo_empty(PTS_PIO, RDR_SM) )
+    if ( (stream_last = pio_sm_get(PTS_PIO, RDR_SM)) & PTS_PIO_DONE )
+      chars[DIR_IN]++;
+  if ( !(stream_last & PTS_PIO_DONE) && (stream_last & 1) )
+    { // teleprinter read
+      if ( !pio_sm_is_tx_fifo_full(PTS_PIO, RDR_SM) && !reader_dma_done() )
+	return; // DMA still filling the FIFO
+      if ( !flash_enter() ) return;
+      next = reader_stream_next();
+      stream_resume = next;
+      stream_left = dma_end - next;
+      stream_paused = TRUE; // before streaming stops, for sum_poll
+      reader_stream_stop();
+      stream_paused = stream_left > 0;
+      stream_last = PTS_PIO_DONE;
+      flash_exit();
+      return;
+    }
+  if ( dma_queued || dma_next != dma_end
+       || !pio_sm_is_tx_fifo_empty(PTS_PIO, RDR_SM)
+       || ( !(stream_last & PTS_PIO_DONE) &&
+	    pio_sm_get_pc(PTS_PIO, RDR_SM)
+	    != rdr_offset + pts_reader_offset_fetch ) )
+    return; // still streaming
+  if ( !flash_enter() ) return; // swap programs once core0 done with flash
+  reader_streaming = FALSE;
+  log_event(EV_STREAM_END, 0, 0);
+  set_reader_program(&pts_reader_staged_program);
+  stage_reader();
+  flash_exit();
+}
+
+/* Next tape character not yet taken by the reader state machine, */
+/* once the DMA has stopped for a full FIFO or the end of the tape */
+
+static inline const uint8_t *__not_in_flash_func(reader_stream_next)()
+{
+  const uint8_t *next = dma_end;
+  for ( uint32_t i = 0 ; i < 2 ; i++ )
+    if ( dma_channel_is_busy(dma_chan[i]) ) // waiting for room
+      next = (const uint8_t *) dma_hw->ch[i].read_addr;
+  return next - pio_sm_get_tx_fifo_level(PTS_PIO, RDR_SM);
+}
+
+/* Abandon the stream, e.g. to mount another tape.  Any character */
+/* already in the state machine is lost with the program.  Called */
+/* between flash_enter and flash_exit, and runs from flash.       */
+
+static void __noinline reader_stream_stop()
+{
+  for ( uint32_t i = 0 ; i < 2 ; i++ )
+    {
+      reader_dma_unchain(i);
+      dma_channel_set_irq1_enabled(dma_chan[i], FALSE);
+      dma_channel_abort(dma_chan[i]);
+      dma_hw->ints1 = 1u << dma_chan[i]; // abort can raise interrupt
+      dma_channel_set_irq1_enabled(dma_chan[i], TRUE);
+    }
+  dma_next = dma_end;
+  dma_queued = 0;
+  reader_streaming = FALSE;
+  log_event(EV_STREAM_END, 0, 1);
+  set_reader_program(&pts_reader_staged_program);
+  stage_reader();
+}
+
+
+/**********************************************************/
+/*                      RING BUFFERS                      */
+/**********************************************************/
+
+
+static inline uint32_t __not_in_flash_func(ring_count)(ring_t *r)
+{
+  return r->head - r->tail;
+}
+
+static inline uint32_t __not_in_flash_func(ring_free)(ring_t *r)
+{
+  return r->size - (r->head - r->tail);
+}
+
+/* Consumer side: returns next character, waiting if necessary */
+
+static inline uint32_t __not_in_flash_func(ring_get)(ring_t *r)
+{
+  uint32_t tail = r->tail, ch;
+  while ( r->head == tail ) tight_loop_contents();
+  __dmb(); // read data after seeing head
+  ch = r->buf[tail & (r->size - 1)];
+  __dmb(); // finish with slot before releasing it
+  r->tail = tail + 1;
+  return ch;
+}
+
+/* Consumer side: look at next character without taking it */
+
+static inline uint32_t __not_in_flash_func(ring_peek)(ring_t *r)
+{
+  __dmb(); // read data after seeing head
+  return r->buf[r->tail & (r->size - 1)];
+}
+
+static inline void __not_in_flash_func(ring_skip)(ring_t *r)
+{
+  __dmb(); // finish with slot before releasing it
+  r->tail = r->tail + 1;
+}
+
+/* Producer side: add up to n characters, returns number added */
+
+static inline uint32_t __not_in_flash_func(ring_write)(ring_t *r,
+						       const uint8_t *s,
+						       uint32_t n)
+{
+  uint32_t head = r->head, space = r->size - (head - r->tail);
+  if ( n > space ) n = space;
+  for ( uint32_t i = 0 ; i < n ; i++ )
+    r->buf[(head + i) & (r->size - 1)] = s[i];
+  __dmb(); // publish data before head
+  r->head = head + n;
+  return n;
+}
+
+/* Producer side: add a character, waiting for room if necessary */
+
+static inline void __not_in_flash_func(ring_put)(ring_t *r, uint32_t ch)
+{
+  uint32_t head = r->head;
+  while ( head - r->tail == r->size ) tight_loop_contents();
+  r->buf[head & (r->size - 1)] = ch;
+  __dmb(); // publish data before head
+  r->head = head + 1;
+}
+
+/* Consumer side: take up to n characters, returns number taken */
+
+static inline uint32_t __not_in_flash_func(ring_read)(ring_t *r, uint8_t *s,
+						      uint32_t n)
+{
+  uint32_t tail = r->tail, count = r->head - tail;
+  if ( n > count ) n = count;
+  __dmb(); // read data after seeing head
+  for ( uint32_t i = 0 ; i < n ; i++ )
+    s[i] = r->buf[(tail + i) & (r->size - 1)];
+  __dmb(); // finish with slots before releasing them
+  r->tail = tail + n;
+  return n;
+}
+
+
+/**********************************************************/
+/*                       STATISTICS                       */
+/**********************************************************/
+
+
+/* Print latency histograms, one line each, bucket counts from 0 uS */
+
+static void print_histograms()
+{
+  hist_print(hist);
+  printf("WAKE %u wake ups, max %u uS, average %u uS\n", wake_count,
+	 wake_max, wake_count ? wake_sum / wake_count : 0);
+}
+
+
+static void hist_print(uint32_t h[HIST_DEVICES][2][HIST_BUCKETS])
+{
+  static const char *kinds[2] = { "req-ack", "ack-clear" };
+  for ( uint32_t d = 0 ; d < HIST_DEVICES ; d++ )
+    for ( uint32_t k = 0 ; k < 2 ; k++ )
+      {
+	printf("HIST %-6s %-9s", hist_names[d], kinds[k]);
+	for ( uint32_t b = 0 ; b < HIST_BUCKETS ; b++ )
+	  printf(" %"PRIu32, h[d][k][b]);
+	putchar('\n');
+      }
+}
+
+
+/* Called by core0 once a second to fold core1's 32 bit counts */
+/* into 64 bit totals.  The counts cannot wrap between calls.   */
+
+static inline void sample_chars(uint32_t secs)
+{
+  static uint32_t last[2] = { 0, 0 };
+  for ( uint32_t dir = DIR_IN ; dir <= DIR_OUT ; dir++ )
+    {
+      uint32_t now = chars[dir];
+      chars_total[dir] += now - last[dir];
+      last[dir] = now;
+      chars_history[dir][secs % RATE_HISTORY] = chars_total[dir];
+    }
+}
+
+/* Average characters per second over the last window seconds */
+
+static inline uint32_t chars_rate(uint32_t dir, uint32_t secs,
+				  uint32_t window)
+{
+  if ( window > secs ) window = secs;
+  if ( window == 0 ) return 0;
+  return (chars_history[dir][secs % RATE_HISTORY]
+	  - chars_history[dir][(secs - window) % RATE_HISTORY]) / window;
+}
+
+
+/**********************************************************/
+/*                        EVENT LOG                       */
+/**********************************************************/
+
+
+/* Record an event, called only by core1.  Never waits. */
+
+static inline void __not_in_flash_func(log_event)(uint32_t code, uint32_t ch,
+						  uint32_t arg)
+{
+  uint32_t head = event_head;
+  event_t *e;
+  if ( !logging_enabled ) return;
+  if ( head - event_tail == EVENT_RING_SIZE )
+    {
+      events_dropped++;
+      return;
+    }
+  e = &event_ring[head & (EVENT_RING_SIZE - 1)];
+  e->time = time_us_32();
+  e->pins = gpio_get_all();
+  e->arg  = arg;
+  e->code = code;
+  e->ch   = ch;
+  __dmb(); // publish record before head
+  event_head = head + 1;
+}
+
+/* Format a few events from core1, called from the core0 loop */
+
+static void log_poll()
+{
+  static const char *names[] =
+    { "?", "TIMEOUT", "WRONG REQUEST", "TEST FAIL", "STREAM START",
+      "STREAM END", "READER EMPTY", "PUNCH FULL", "READ", "PUNCH" };
+  static uint32_t reported_dropped = 0;
+  uint32_t tail = event_tail, dropped;
+  for ( uint32_t n = 0 ; n < EVENT_BATCH && tail != event_head ; n++ )
+    {
+      event_t e;
+      __dmb(); // read record after seeing head
+      e = event_ring[tail & (EVENT_RING_SIZE - 1)];
+      __dmb(); // finish with record before releasing it
+      event_tail = ++tail;
+      printf("EVENT %10u %-13s ch %03o arg %u RDRREQ %u PUNREQ %u "
+	     "TTYSEL %u pins %08x\n", e.time,
+	     names[e.code < count_of(names) ? e.code : 0], e.ch, e.arg,
+	     (e.pins & RDRREQ_BIT) != 0,
+	     (e.pins & PUNREQ_BIT) != 0,
+	     (e.pins >> TTYSEL_PIN) & 1, e.pins);
+    }
+  if ( (dropped = events_dropped) != reported_dropped )
+    {
+      printf("EVENT %u records dropped\n", dropped - reported_dropped);
+      reported_dropped = dropped;
+    }
+}
+
+
+/**********************************************************/
+/*                   RUN LENGTH CODING                    */
+/**********************************************************/
+
+
+/* Decode up to n characters from *in, which is advanced, into out */
+/* (if out is NULL they are only counted).  At most two bytes are  */
+/* taken for each character produced, so the cost per character is */
+/* bounded.  Returns the number of characters produced.            */
+
+static uint32_t rle_decode(rle_decoder_t *d, const uint8_t **in,
+			   const uint8_t *end, uint8_t *out, uint32_t n)
+{
+  uint32_t done = 0, b;
+  while ( done < n )
+    {
+      if ( d->state == RLE_RUNNING && d->count )
+	{
+	  if ( out ) out[done] = d->ch;
+	  done++;
+	  d->count--;
+	  continue;
+	}
+      if ( *in == end ) break;
+      b = *(*in)++;
+      if ( d->state == RLE_LITERAL && d->count )
+	{
+	  if ( out ) out[done] = b;
+	  done++;
+	  d->count--;
+	}
+      else if ( d->state == RLE_CHAR )
+	{
+	  d->ch = b;
+	  d->state = RLE_RUNNING;
+	}
+      else if ( b & RLE_RUN )
+	{
+	  d->count = (b & ~RLE_RUN) + RLE_RUN_MIN;
+	  d->state = RLE_CHAR;
+	}
+      else
+	{
+	  d->count = b + 1;
+	  d->state = RLE_LITERAL;
+	}
+    }
+  return done;
+}
+
+/* Characters coded by n bytes */
+
+static uint32_t rle_length(const uint8_t *s, uint32_t n)
+{
+  rle_decoder_t d = { 0, 0, 0 };
+  return rle_decode(&d, &s, s + n, NULL, UINT32_MAX);
+}
+
+static uint32_t rle_flush_literal(rle_coder_t *c, uint8_t *out)
+{
+  uint32_t n = c->literal_count;
+  if ( n == 0 ) return 0;
+  out[0] = n - 1;
+  memcpy(out + 1, c->literal, n);
+  c->literal_count = 0;
+  return n + 1;
+}
+
+static uint32_t rle_flush_run(rle_coder_t *c, uint8_t *out)
+{
+  uint32_t n = 0;
+  if ( c->run_count >= RLE_RUN_MIN )
+    {
+      n = rle_flush_literal(c, out);
+      out[n++] = RLE_RUN | (c->run_count - RLE_RUN_MIN);
+      out[n++] = c->run_ch;
+    }
+  else // too short, add to literal span
+    for ( uint32_t i = 0 ; i < c->run_count ; i++ )
+      {
+	if ( c->literal_count == RLE_LITERAL_MAX )
+	  n += rle_flush_literal(c, out + n);
+	c->literal[c->literal_count++] = c->run_ch;
+      }
+  c->run_count = 0;
+  return n;
+}
+
+/* Code a character, returns the number of bytes put in out, */
+/* which is never more than RLE_RUN_MAX + 1.                 */
+
+static uint32_t rle_code(rle_coder_t *c, uint32_t ch, uint8_t *out)
+{
+  uint32_t n = 0;
+  if ( c->run_count && ch == c->run_ch && c->run_count < RLE_RUN_MAX )
+    {
+      c->run_count++;
+      return 0;
+    }
+  n = rle_flush_run(c, out);
+  c->run_ch = ch;
+  c->run_count = 1;
+  return n;
+}
+
+/* Put whatever the coder is holding in out, returns bytes */
+
+static uint32_t rle_finish(rle_coder_t *c, uint8_t *out)
+{
+  uint32_t n = rle_flush_run(c, out);
+  return n + rle_flush_literal(c, out + n);
+}
+
+
+/**********************************************************/
+/*                    TELEPRINTER CODES                   */
+/**********************************************************/
+
+
+/* Build the tables for the keyboard, the reverse of telecode for */
+/* 5 hole code, and both ways for 8 hole code.  Lower case is     */
+/* typed as upper, there being none on the teleprinter.           */
+
+static void set_up_console()
+{
+  for ( uint32_t shift = 0 ; shift < 2 ; shift++ )
+    for ( uint32_t code = 1 ; code < TELE_LS ; code++ )
+      {
+	uint32_t ch = (uint8_t) telecode[shift][code];
+	if ( ch == 0 || console_in[0][ch] ) continue;
+	console_in[0][ch] = code
+	  | (ch == ' ' || ch == '\r' || ch == '\n' ? 0 // either shift
+	     : shift ? TELE_FIGURES : TELE_LETTERS);
+      }
+  for ( uint32_t ch = 1 ; ch < 128 ; ch++ )
+    {
+      uint32_t parity = __builtin_popcount(ch) & 1;
+      console_in[1][ch] = ch | (parity << 7);
+      console_out8[ch] = ch == 0177 ? 0 : ch == '#' ? POUND : ch;
+    }
+  console_in[1][POUND] = console_in[1]['#'];
+  for ( uint32_t ch = 'a' ; ch <= 'z' ; ch++ )
+    {
+      console_in[0][ch] = console_in[0][ch - 'a' + 'A'];
+      console_in[1][ch] = console_in[1][ch - 'a' + 'A'];
+    }
+}
+
+/* Put a character typed on the host on the keyboard ring, lost if */
+/* there is no room                                                */
+
+static inline void keyboard_put(uint32_t code)
+{
+  if ( ring_free(&keyboard_ring) ) ring_put(&keyboard_ring, code);
+}
+
+/* Type a character from the host, in the teleprinter's code.  A   */
+/* shift is sent first if the character needs one not already in  */
+/* force and anything with no equivalent is ignored.               */
+
+static void console_type(uint32_t ch)
+{
+  static uint32_t last = 0;
+  uint32_t code;
+  if ( console_code == CODE_RAW )
+    {
+      keyboard_put(ch);
+      return;
+    }
+  if ( ch == '\n' && last == '\r' ) ch = 0; // CR LF already sent
+  last = ch;
+  if ( ch == '\n' ) ch = '\r';
+  if ( (code = console_in[console_code - CODE_5HOLE][ch]) == 0 ) return;
+  if ( console_code == CODE_5HOLE )
+    {
+      uint32_t shift = code & TELE_SHIFT;
+      if ( shift && shift != keyboard_shift )
+	{
+	  keyboard_put(shift == TELE_FIGURES ? TELE_FS : TELE_LS);
+	  keyboard_shift = shift;
+	}
+      code &= ~TELE_SHIFT;
+    }
+  keyboard_put(code);
+  if ( ch == '\r' )
+    keyboard_put(console_code == CODE_5HOLE ? TELE_LF
+		 : console_in[1]['\n']);
+}
+
+/* Translate n characters printed into ASCII (UTF-8 for the pound */
+/* sign) at out, which must have room for 2n bytes.  Returns the  */
+/* number of bytes.  Shifts, blanks and erases print nothing.     */
+
+static uint32_t console_translate(const uint8_t *in, uint32_t n,
+				  uint8_t *out)
+{
+  uint8_t *p = out;
+  for ( uint32_t i = 0 ; i < n ; i++ )
+    {
+      uint32_t ch = in[i];
+      if ( console_code == CODE_5HOLE )
+	{
+	  ch &= 31;
+	  if ( ch == TELE_FS || ch == TELE_LS )
+	    {
+	      printer_shift = ch == TELE_FS;
+	      continue;
+	    }
+	  ch = (uint8_t) telecode[printer_shift][ch];
+	}
+      else if ( console_code == CODE_8HOLE )
+	ch = console_out8[ch & 127];
+      else
+	{
+	  *p++ = ch;
+	  continue;
+	}
+      if ( ch == POUND ) *p++ = UTF8_POUND;
+      if ( ch ) *p++ = ch;
+    }
+  return p - out;
+}
+
+
+/**********************************************************/
+/*                        CHECKSUMS                       */
+/**********************************************************/
+
+
+/* Add a character to a CRC-32, a nibble at a time by table */
+
+static uint32_t crc32_add(uint32_t crc, uint32_t ch)
+{
+  static const uint32_t table[16] =
+    { 0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+      0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+      0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+  crc ^= ch;
+  crc = (crc >> 4) ^ table[crc & 15];
+  return (crc >> 4) ^ table[crc & 15];
+}
+
+
+/* The sniffer watches only sum_chan, which is never used for */
+/* anything else.  A byte transfer may be seen across the whole */
+/* bus, so SNIFF_SUM can add up each byte times 0x01010101: a   */
+/* byte of 1 is summed to find out, and the inverse of what it  */
+/* gives (always odd) kept to scale sums back.                  */
+
+static void set_up_sums()
+{
+  static const uint8_t one = 1;
+  uint32_t unit;
+  sum_chan = dma_claim_unused_channel(true);
+  sum_config = dma_channel_get_default_config(sum_chan);
+  channel_config_set_transfer_data_size(&sum_config, DMA_SIZE_8);
+  channel_config_set_read_increment(&sum_config, TRUE);
+  channel_config_set_write_increment(&sum_config, FALSE);
+  channel_config_set_sniff_enable(&sum_config, TRUE);
+  unit = sum_sniff(SNIFF_SUM, 0, &one, 1);
+  sum_scale = unit; // right to 3 bits, Newton doubles that each time
+  for ( uint32_t i = 0 ; i < 4 ; i++ ) sum_scale *= 2 - unit * sum_scale;
+  sum_reset(&read_sum);
+  sum_reset(&punch_sum);
+}
+
+static void sum_reset(tape_sum_t *t)
+{
+  t->crc = CRC_INIT;
+  t->sum = t->length = 0;
+}
+
+/* Run the sniffer in mode over n characters, starting from seed */
+
+static uint32_t sum_sniff(uint32_t mode, uint32_t seed, const uint8_t *s,
+			  uint32_t n)
+{
+  dma_sniffer_enable(sum_chan, mode, TRUE);
+  dma_hw->sniff_data = seed;
+  dma_channel_configure(sum_chan, &sum_config, &sum_sink, s, n, TRUE);
+  dma_channel_wait_for_finish_blocking(sum_chan);
+  return dma_hw->sniff_data;
+}
+
+/* Both sums come from the sniffer, one pass each, so the CPU only */
+/* waits for the DMA.  The sniffer holds one tape's CRC at a time, */
+/* so it is loaded before and saved after.                         */
+
+static void sum_add(tape_sum_t *t, const uint8_t *s, uint32_t n)
+{
+  if ( n == 0 ) return;
+  t->crc = sum_sniff(SNIFF_CRC32R, t->crc, s, n);
+  t->sum = (t->sum + sum_sniff(SNIFF_SUM, 0, s, n) * sum_scale) & SUM_MASK;
+  t->length += n;
+  t->last = time_us_32();
+}
+
+/* Finish the sniffer's CRC, which is bit reversed and inverted */
+/* to give the usual CRC-32                                      */
+
+static void sum_print(const tape_sum_t *t, const char *what)
+{
+  uint32_t crc = 0;
+  for ( uint32_t i = 0 ; i < 32 ; i++ )
+    crc = (crc << 1) | ((t->crc >> i) & 1);
+  printf("TAPE %s length %u crc %08x sum %06o\n", what, t->length, ~crc,
+	 t->sum);
+}
+
+static void sum_end(tape_sum_t *t, tape_sum_t *done, const char *what)
+{
+  if ( t->length == 0 ) return;
+  sum_print(t, what);
+  *done = *t;
+  sum_reset(t);
+}
+
+/* Add reader characters core1 has used since last time.  Called */
+/* whenever core0 is about to refill the reader ring.            */
+
+static void read_sum_poll()
+{
+  uint32_t tail = reader_ring.tail, n, i;
+  if ( read_resync )
+    {
+      if ( mount_pending ) return;
+      read_summed = tail; // flushed characters were not read
+      read_resync = FALSE;
+    }
+  while ( (n = tail - read_summed) )
+    {
+      i = read_summed & (reader_ring.size - 1);
+      n = MIN(n, reader_ring.size - i); // up to the end of the buffer
+      sum_add(&read_sum, &reader_ring.buf[i], n);
+      read_summed += n;
+    }
+}
+
+/* Called from the core0 loop */
+
+static inline void sum_poll()
+{
+  uint32_t now = time_us_32();
+  read_sum_poll();
+  if ( sum_stream && !mount_pending && !reader_streaming && !stream_paused )
+    { // stream finished
+      uint32_t n = MIN(sum_stream_left, SUM_CHUNK);
+      sum_add(&read_sum, sum_stream, n);
+      sum_stream += n;
+      if ( (sum_stream_left -= n) == 0 ) sum_stream = NULL;
+    }
+  if ( read_sum.length && !sum_stream && now - read_sum.last > TAPE_IDLE_US )
+    sum_end(&read_sum, &read_done, "READ");
+  if ( punch_sum.length && now - punch_sum.last > TAPE_IDLE_US )
+    sum_end(&punch_sum, &punch_done, "PUNCHED");
+}
+
+
+/**********************************************************/
+/*                          FLASH                         */
+/**********************************************************/
+
+
+/* core0 writes flash while core1 carries on.  Everything core1 */
+/* does while transferring runs from SRAM.  Anything else it    */
+/* does that runs from flash (loading PIO programs, say) is     */
+/* bracketed by flash_enter and flash_exit and is put off while */
+/* core0 is writing.  The DMA reader stream reads flash, so     */
+/* while one runs the reader state machine is stopped while     */
+/* idle, with its FIFO full so that no DMA transfer can start,  */
+/* unless the DMA has finished already, when there is no need.  */
+/* core1 leaves the stream alone as long as flash is busy.      */
+
+static inline uint32_t flash_begin()
+{
+  uint32_t start;
+  flash_busy = TRUE;
+  __dmb(); // claim flash before looking at core1
+  while ( core1_in_flash ) tight_loop_contents(); // never for long
+  if ( !reader_streaming || reader_dma_done() ) return TRUE;
+  start = time_us_32();
+  do
+    {
+      sm_set_enabled(RDR_SM, FALSE); // hold the reader
+      if ( pio_sm_is_tx_fifo_full(PTS_PIO, RDR_SM)
+	   && ( pio_sm_get_pc(PTS_PIO, RDR_SM)
+		== rdr_offset + pts_reader_offset_idle
+		|| pio_sm_get_pc(PTS_PIO, RDR_SM)
+		== rdr_offset + pts_reader_offset_tty ) )
+	{
+	  stream_held = TRUE;
+	  return TRUE;
+	}
+      sm_set_enabled(RDR_SM, TRUE); // mid transfer
+    }
+  while ( time_us_32() - start < FLASH_HOLD_US );
+  flash_end();
+  return FALSE;
+}
+
+/* TRUE once the DMA stream has read the last of the tape */
+
+static inline uint32_t __not_in_flash_func(reader_dma_done)()
+{
+  return dma_next == dma_end && !dma_channel_is_busy(dma_chan[0])
+    && !dma_channel_is_busy(dma_chan[1]);
+}
+
+static inline void flash_end()
+{
+  __dmb(); // finish with flash before releasing it
+  if ( stream_held ) sm_set_enabled(RDR_SM, TRUE);
+  stream_held = FALSE;
+  flash_busy = FALSE;
+  __sev(); // wake core1 if it put anything off
+}
+
+/* core1: TRUE if it may run from flash until flash_exit */
+
+static inline uint32_t __not_in_flash_func(flash_enter)()
+{
+  core1_in_flash = TRUE;
+  __dmb(); // claim flash before looking at core0
+  if ( !flash_busy ) return TRUE;
+  core1_in_flash = FALSE;
+  return FALSE;
+}
+
+static inline void __not_in_flash_func(flash_exit)()
+{
+  __dmb();
+  core1_in_flash = FALSE;
+}
+
+/* Erase a sector of flash (offset from the start) if erase and  */
+/* program it with data if any.  Interrupts are off on core0     */
+/* meanwhile.  FALSE if a stream is reading the flash and has    */
+/* not been idle within FLASH_HOLD_US.                           */
+
+static uint32_t flash_write(uint32_t offset, const uint8_t *data,
+			    uint32_t erase)
+{
+  uint32_t status;
+  if ( !flash_begin() ) return FALSE;
+  status = save_and_disable_interrupts();
+  if ( erase ) flash_range_erase(offset, FLASH_SECTOR_SIZE);
+  if ( data ) flash_range_program(offset, data, FLASH_SECTOR_SIZE);
+  restore_interrupts(status);
+  flash_end();
+  return TRUE;
+}
+
+
+/**********************************************************/
+/*                      PUNCH CAPTURE                     */
+/**********************************************************/
+
+
+static inline const capture_header_t *capture_sector(uint32_t i)
+{
+  return (const capture_header_t *)
+    (XIP_BASE + CAPTURE_OFFSET + i * FLASH_SECTOR_SIZE);
+}
+
+/* Called by core0 at start up.  Carry on after the newest sector */
+/* in the log, starting a new tape.                               */
+
+static void set_up_capture()
+{
+  capture_ok = library_ok; // the log is after the library
+  capture_next = 0;
+  capture_sequence = 1;
+  capture_tape = 1;
+  for ( uint32_t i = 0 ; capture_ok && i < CAPTURE_SECTORS ; i++ )
+    {
+      const capture_header_t *h = capture_sector(i);
+      if ( h->magic == CAPTURE_MAGIC && h->sequence >= capture_sequence )
+	{
+	  capture_sequence = h->sequence + 1;
+	  capture_next = (i + 1) % CAPTURE_SECTORS;
+	  capture_tape = h->tape + 1;
+	}
+    }
+}
+
+/* Characters of punch output that may be captured now.  The  */
+/* coder may release up to RLE_SLACK bytes for the last one     */
+/* and hold back as many again, so that much is kept in hand.   */
+
+static inline uint32_t capture_room()
+{
+  uint32_t room = CAPTURE_DATA - capture_fill;
+  if ( capture_full[capture_fill_buf] || room <= RLE_SLACK ) return 0;
+  return MIN(room - RLE_SLACK, RLE_LITERAL_MAX);
+}
+
+/* Capture n characters, no more than capture_room() */
+
+static inline void capture_add(const uint8_t *s, uint32_t n)
+{
+  uint8_t *out = &capture_buf[capture_fill_buf][sizeof(capture_header_t)];
+  for ( uint32_t i = 0 ; i < n ; i++ )
+    capture_fill += rle_code(&capture_rle, s[i], out + capture_fill);
+  capture_open = TRUE;
+  capture_last = time_us_32();
+  if ( CAPTURE_DATA - capture_fill <= RLE_SLACK )
+    capture_close(FALSE);
+}
+
+/* Capture as much of n characters as there is room for, the rest */
+/* being lost from the tape, for output the host is taking too.   */
+
+static void capture_spare(const uint8_t *s, uint32_t n)
+{
+  uint32_t m;
+  while ( n && (m = MIN(n, capture_room())) )
+    {
+      capture_add(s, m);
+      s += m;
+      n -= m;
+    }
+  if ( n == 0 ) return;
+  capture_lost += n;
+  capture_tape_lost += n;
+  capture_open = TRUE; // so the tape still ends
+  capture_last = time_us_32();
+}
+
+/* Flush the coder and hand the buffer being filled to capture_poll */
+/* and switch to the other one, which is not full.  If end the tape */
+/* finishes here.                                                   */
+
+static void capture_close(uint32_t end)
+{
+  capture_header_t *h = (capture_header_t *) capture_buf[capture_fill_buf];
+  capture_fill += rle_finish(&capture_rle, (uint8_t *) (h + 1)
+			     + capture_fill);
+  h->magic  = CAPTURE_MAGIC;
+  h->tape   = capture_tape;
+  h->length = capture_fill;
+  h->flags  = end ? CAPTURE_END : 0;
+  capture_full[capture_fill_buf] = TRUE;
+  capture_fill_buf ^= 1;
+  capture_fill = 0;
+  if ( end )
+    {
+      if ( capture_tape_lost )
+	printf("CAPTURE tape %u lost %u characters\n", capture_tape,
+	       capture_tape_lost);
+      capture_tape_lost = 0;
+      capture_tape++;
+      capture_open = FALSE;
+    }
+}
+
+/* Called from the core0 loop, does at most one flash operation. */
+/* The next sector is erased as soon as the last one is written  */
+/* so that writing a full buffer is only a program cycle.        */
+
+static void capture_poll()
+{
+  uint32_t offset = CAPTURE_OFFSET + capture_next * FLASH_SECTOR_SIZE;
+  if ( !capture_ok ) return;
+  if ( capture_open && !capture_full[capture_fill_buf]
+       && time_us_32() - capture_last >= CAPTURE_IDLE_US )
+    capture_close(TRUE); // punch stopped after runout
+  if ( !capture_erased )
+    capture_erased = flash_write(offset, NULL, TRUE);
+  else if ( capture_full[capture_write_buf] )
+    {
+      uint8_t *buf = capture_buf[capture_write_buf];
+      ((capture_header_t *) buf)->sequence = capture_sequence;
+      if ( !flash_write(offset, buf, FALSE) ) return; // try again later
+      capture_full[capture_write_buf] = FALSE;
+      capture_write_buf ^= 1;
+      capture_sequence++;
+      capture_next = (capture_next + 1) % CAPTURE_SECTORS;
+      capture_erased = FALSE;
+    }
+}
+
+/* Print the captured tapes still in the log, oldest first, with */
+/* their lengths in characters and whether they are complete,    */
+/* then OK.                                                      */
+
+static void capture_list()
+{
+  uint32_t tape = 0, length = 0;
+  for ( uint32_t i = 0 ; capture_ok && i <= CAPTURE_SECTORS ; i++ )
+    {
+      const capture_header_t *h =
+	capture_sector((capture_next + i) % CAPTURE_SECTORS);
+      uint32_t valid = i < CAPTURE_SECTORS && h->magic == CAPTURE_MAGIC;
+      if ( tape && (!valid || h->tape != tape) )
+	{
+	  printf("PUNCHED %6u %8u partial\n", tape, length);
+	  tape = 0;
+	}
+      if ( !valid ) continue;
+      if ( tape == 0 )
+	{
+	  tape = h->tape;
+	  length = 0;
+	}
+      length += rle_length((const uint8_t *) (h + 1), h->length);
+      if ( h->flags & CAPTURE_END )
+	{
+	  printf("PUNCHED %6u %8u\n", tape, length);
+	  tape = 0;
+	}
+    }
+  puts("OK");
+}
+
+/* Send captured tape to the host, "OK bytes" then the tape run */
+/* length coded, sector by sector.                              */
+
+static void capture_get(uint32_t tape)
+{
+  uint32_t length = 0, pass;
+  for ( pass = 0 ; pass < 2 ; pass++ )
+    {
+      for ( uint32_t i = 0 ; capture_ok && i < CAPTURE_SECTORS ; i++ )
+	{
+	  const capture_header_t *h =
+	    capture_sector((capture_next + i) % CAPTURE_SECTORS);
+	  if ( h->magic != CAPTURE_MAGIC || h->tape != tape ) continue;
+	  if ( pass == 0 )
+	    length += h->length;
+	  else
+	    host_write((const uint8_t *) (h + 1), h->length);
+	}
+      if ( pass == 0 && length == 0 )
+	{
+	  printf("ERROR no tape %u\n", tape);
+	  return;
+	}
+      if ( pass == 0 ) printf("OK %u\n", length);
+    }
+}
+
+
+/**********************************************************/
+/*                      TAPE LIBRARY                      */
+/**********************************************************/
+
+
+static inline const tape_index_t *library_index(uint32_t n)
+{
+  return (const tape_index_t *)
+    (XIP_BASE + library_dir[n].offset - FLASH_SECTOR_SIZE);
+}
+
+/* Called by core0 at start up.  The library is only used if the */
+/* program ends before it, and then any boot tape is mounted.    */
+
+static void set_up_library()
+{
+  library_ok = (uint32_t) (&__flash_binary_end - (char *) XIP_BASE)
+    <= LIBRARY_OFFSET;
+  if ( !library_ok )
+    {
+      if ( logging_enabled ) puts("Program overlaps tape library - disabled");
+      return;
+    }
+  for ( uint32_t n = 0 ; n < LIBRARY_TAPES ; n++ )
+    if ( library_dir[n].magic == LIBRARY_MAGIC
+	 && (library_dir[n].flags & TAPE_BOOT) )
+      {
+	if ( logging_enabled ) puts("Mounting boot tape");
+	library_mount(n, FALSE);
+	break;
+      }
+}
+
+/* Print the directory, one line per tape, then OK */
+
+static void library_list()
+{
+  for ( uint32_t n = 0 ; n < LIBRARY_TAPES ; n++ )
+    if ( library_dir[n].magic == LIBRARY_MAGIC )
+      printf("TAPE %3u %8u %8u %4u %c%c %.*s\n", n, library_dir[n].length,
+	     library_dir[n].size, library_index(n)->count == UINT32_MAX
+	     ? 0 : library_index(n)->count,
+	     (library_dir[n].flags & TAPE_BOOT) ? 'B' : '-',
+	     (library_dir[n].flags & TAPE_RLE) ? 'R' : '-',
+	     TAPE_NAME_SIZE, library_dir[n].name);
+  puts("OK");
+}
+
+/* Ask core1 to stream tape n (or none if n is out of range) to   */
+/* the reader, or if it is coded decode it into the reader ring.   */
+/* If boot it is also the tape mounted at start up in future (none */
+/* if n is out of range).                                          */
+
+static void library_mount(uint32_t n, uint32_t boot)
+{
+  const tape_entry_t *e = n < LIBRARY_TAPES ? &library_dir[n] : NULL;
+  if ( mount_pending || store_active || bench_pending )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  if ( e && (!library_ok || e->magic != LIBRARY_MAGIC) )
+    {
+      printf("ERROR no tape %u\n", n);
+      return;
+    }
+  if ( boot && library_ok && !(e && (e->flags & TAPE_BOOT)) )
+    { // rewrite directory with only this tape marked for boot
+      tape_entry_t *dir = (tape_entry_t *) sector_buf;
+      memcpy(sector_buf, library_dir, FLASH_SECTOR_SIZE);
+      for ( uint32_t i = 0 ; i < LIBRARY_TAPES ; i++ )
+	if ( dir[i].magic == LIBRARY_MAGIC )
+	  {
+	    if ( i == n ) dir[i].flags |= TAPE_BOOT;
+	    else dir[i].flags &= ~TAPE_BOOT;
+	  }
+      if ( !flash_write(LIBRARY_OFFSET, sector_buf, TRUE) )
+	{
+	  puts("ERROR busy");
+	  return;
+	}
+    }
+  mounted = e ? n : LIBRARY_TAPES;
+  tape_start(e, NULL, FALSE);
+  puts("OK");
+}
+
+/* H_SEEK: restart the mounted tape at a block from its index */
+
+static void library_seek(uint32_t block)
+{
+  const tape_index_t *ix;
+  if ( mounted == LIBRARY_TAPES )
+    {
+      puts("ERROR no tape mounted");
+      return;
+    }
+  ix = library_index(mounted);
+  if ( ix->count == UINT32_MAX || block >= ix->count )
+    {
+      printf("ERROR no block %u\n", block);
+      return;
+    }
+  if ( mount_pending )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  tape_start(&library_dir[mounted], &ix->blocks[block], TRUE);
+  printf("OK %u\n", ix->blocks[block].position);
+}
+
+/* Have tape e (none if NULL) read from block b (the start if NULL). */
+/* A plain tape is streamed by core1, unless pacing or calibrating.  */
+/* Otherwise core0                                                   */
+/* copies or decodes it into the reader ring, starting once core1    */
+/* has dealt with the request, from the record holding the block.    */
+
+static void tape_start(const tape_entry_t *e, const index_entry_t *b,
+		       uint32_t flush)
+{
+  const uint8_t *image = e ? (const uint8_t *) XIP_BASE + e->offset : NULL;
+  uint32_t position = b ? b->position : 0;
+  read_sum_poll();
+  sum_end(&read_sum, &read_done, "READ"); // previous tape ends
+  read_resync = flush;
+  tape_next = NULL;
+  mount_tape = NULL;
+  mount_length = 0;
+  if ( e && (e->flags & TAPE_RLE) )
+    {
+      memset(&tape_rle, 0, sizeof(tape_rle));
+      tape_coded = TRUE;
+      tape_end = image + e->size;
+      tape_next = image + (b ? b->offset : 0);
+      if ( b ) rle_decode(&tape_rle, &tape_next, tape_end, NULL, b->skip);
+    }
+  else if ( e && (pacing || cal_pending) )
+    {
+      tape_coded = FALSE;
+      tape_end = image + e->length;
+      tape_next = image + position;
+    }
+  else if ( e )
+    {
+      mount_tape = image + position;
+      mount_length = e->length - position;
+    }
+  sum_stream = mount_tape; // summed once streamed
+  sum_stream_left = mount_length;
+  mount_flush = flush;
+  __dmb(); // publish tape before request
+  mount_pending = TRUE;
+  __sev(); // wake core1 if idle
+}
+
+/* Empty the library.  The tape images are left to be overwritten, */
+/* so not while one is being streamed.                             */
+
+static void library_erase()
+{
+  if ( !library_ok || store_active || reader_streaming || stream_paused )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  memset(sector_buf, 0xFF, FLASH_SECTOR_SIZE);
+  tape_next = NULL; // stop decoding any coded tape
+  mounted = LIBRARY_TAPES;
+  puts(flash_write(LIBRARY_OFFSET, sector_buf, TRUE) ? "OK" : "ERROR busy");
+}
+
+/* H_STORE: claim space after the last tape in the library */
+
+static void store_begin()
+{
+  uint32_t end = LIBRARY_OFFSET + FLASH_SECTOR_SIZE;
+  if ( !library_ok || store_active || host_cmd_len < 7 )
+    {
+      puts("ERROR cannot store");
+      return;
+    }
+  for ( uint32_t n = 0 ; n < LIBRARY_TAPES ; n++ )
+    if ( library_dir[n].magic == LIBRARY_MAGIC )
+      {
+	uint32_t e = library_dir[n].offset + library_dir[n].size;
+	e = (e + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+	if ( e > end ) end = e;
+      }
+  store_expected = host_cmd[0] | (host_cmd[1] << 8) | (host_cmd[2] << 16)
+    | (host_cmd[3] << 24);
+  end += FLASH_SECTOR_SIZE; // for the index
+  if ( end > LIBRARY_OFFSET + LIBRARY_SIZE // no room for the index
+       || store_expected > LIBRARY_OFFSET + LIBRARY_SIZE - end ) // no wrap
+    {
+      puts("ERROR library full");
+      return;
+    }
+  memset(&store_entry, 0, sizeof(store_entry));
+  store_entry.magic  = LIBRARY_MAGIC;
+  store_entry.offset = end;
+  store_entry.flags  = host_cmd[4] & (TAPE_RLE | TAPE_MARKER);
+  store_mark = host_cmd[5];
+  if ( !(store_entry.flags & TAPE_MARKER) && store_mark == 0 )
+    store_mark = INDEX_BLANKS;
+  memcpy(store_entry.name, &host_cmd[6],
+	 MIN(host_cmd_len - 6, TAPE_NAME_SIZE - 1));
+  memset(&store_rle, 0, sizeof(store_rle));
+  memset(&store_index, 0xFF, sizeof(store_index));
+  store_index.count = 0;
+  store_blanks = store_mark; // so leader counts as a gap
+  store_record = store_skip = 0;
+  store_fill = 0;
+  store_crc = CRC_INIT;
+  store_active = TRUE;
+  puts("OK");
+}
+
+/* H_DATA: write the tape a sector at a time */
+
+static void store_data(const uint8_t *s, uint32_t n)
+{
+  const uint8_t *in = s;
+  uint32_t size = store_entry.size;
+  uint8_t ch;
+  if ( !store_active ) return;
+  if ( store_entry.flags & TAPE_RLE )
+    while ( TRUE )
+      {
+	if ( store_rle.count == 0 ) // next byte starts a record
+	  {
+	    store_record = size + (in - s);
+	    store_skip = 0;
+	  }
+	if ( rle_decode(&store_rle, &in, s + n, &ch, 1) == 0 ) break;
+	store_index_char(ch, store_record, store_skip++);
+	store_crc = crc32_add(store_crc, ch);
+	store_entry.length++;
+      }
+  else
+    for ( uint32_t i = 0 ; i < n ; i++ )
+      {
+	store_index_char(s[i], size + i, 0);
+	store_crc = crc32_add(store_crc, s[i]);
+	store_entry.length++;
+      }
+  while ( n-- )
+    {
+      if ( store_entry.size++ == store_expected )
+	{ // more than promised, so no room
+	  store_active = FALSE;
+	  puts("ERROR tape too long");
+	  return;
+	}
+      sector_buf[store_fill++] = *s++;
+      if ( store_fill == FLASH_SECTOR_SIZE )
+	{
+	  if ( !flash_write(store_entry.offset + store_entry.size
+			    - FLASH_SECTOR_SIZE, sector_buf, TRUE) )
+	    {
+	      store_active = FALSE;
+	      puts("ERROR busy");
+	      return;
+	    }
+	  store_fill = 0;
+	}
+    }
+}
+
+/* Note where blocks start as characters are stored */
+
+static void store_index_char(uint32_t ch, uint32_t offset, uint32_t skip)
+{
+  uint32_t start;
+  if ( store_entry.flags & TAPE_MARKER )
+    start = ch == store_mark;
+  else
+    {
+      start = ch != 0 && store_blanks >= store_mark;
+      store_blanks = ch ? 0 : store_blanks + 1;
+    }
+  if ( start && store_index.count < INDEX_BLOCKS )
+    {
+      index_entry_t *b = &store_index.blocks[store_index.count++];
+      b->position = store_entry.length;
+      b->offset = offset;
+      b->skip = skip;
+    }
+}
+
+/* H_END: write the last part sector, the index and then the */
+/* directory entry                                           */
+
+static void store_end()
+{
+  tape_entry_t *dir = (tape_entry_t *) sector_buf;
+  uint32_t n;
+  if ( !store_active )
+    {
+      puts("ERROR not storing");
+      return;
+    }
+  store_active = FALSE;
+  if ( store_fill )
+    {
+      memset(&sector_buf[store_fill], 0xFF, FLASH_SECTOR_SIZE - store_fill);
+      if ( !flash_write(store_entry.offset + store_entry.size - store_fill,
+			sector_buf, TRUE) )
+	{
+	  puts("ERROR busy");
+	  return;
+	}
+    }
+  for ( n = 0 ; n < LIBRARY_TAPES ; n++ )
+    if ( library_dir[n].magic != LIBRARY_MAGIC ) break;
+  if ( n == LIBRARY_TAPES )
+    {
+      puts("ERROR directory full");
+      return;
+    }
+  if ( !flash_write(store_entry.offset - FLASH_SECTOR_SIZE,
+		    (const uint8_t *) &store_index, TRUE) )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  memcpy(sector_buf, library_dir, FLASH_SECTOR_SIZE);
+  dir[n] = store_entry;
+  if ( flash_write(LIBRARY_OFFSET, sector_buf, TRUE) )
+    printf("OK %u length %u crc %08x\n", n, store_entry.length, ~store_crc);
+  else
+    puts("ERROR busy");
+}
+
+
+/**********************************************************/
+/*                        HOST LINK                       */
+/**********************************************************/
+
+
+/* Room core0 may fill in the reader ring.  Filling starts when */
+/* the ring falls below READER_RING_LOW and continues until it   */
+/* rises above READER_RING_HIGH so that core1 is never left      */
+/* waiting on USB while there is tape in the ring.               */
+
+static inline uint32_t reader_room()
+{
+  read_sum_poll(); // before used slots are refilled
+  if ( !reader_filling )
+    {
+      if ( ring_count(&reader_ring) >= READER_RING_LOW ) return 0;
+      reader_filling = TRUE;
+    }
+  return ring_free(&reader_ring);
+}
+
+/* Add up to reader_room() characters to the reader ring */
+
+static inline uint32_t reader_fill(const uint8_t *s, uint32_t n)
+{
+  n = ring_write(&reader_ring, s, n);
+  if ( ring_count(&reader_ring) > READER_RING_HIGH )
+    reader_filling = FALSE;
+  return n;
+}
+
+/* Decode coded tape from *in into the reader ring, as much as   */
+/* there is room for but no more than max characters             */
+
+static uint32_t reader_decode(rle_decoder_t *d, const uint8_t **in,
+			      const uint8_t *end, uint32_t max)
+{
+  uint8_t buf[64];
+  uint32_t n, total = 0;
+  while ( (n = MIN(MIN(reader_room(), sizeof(buf)), max - total)) )
+    {
+      if ( (n = rle_decode(d, in, end, buf, n)) == 0 ) break;
+      total += reader_fill(buf, n);
+    }
+  return total;
+}
+
+/* Feed a mounted tape not being streamed by DMA into the reader */
+/* ring, called from the core0 loop                              */
+
+static inline void tape_poll()
+{
+  if ( !tape_next || mount_pending ) return; // core1 may empty ring
+  if ( tape_coded )
+    reader_decode(&tape_rle, &tape_next, tape_end, TAPE_POLL_MAX);
+  else
+    tape_next += reader_fill(tape_next, MIN(MIN(reader_room(),
+						tape_end - tape_next),
+					    TAPE_POLL_MAX));
+  if ( tape_next == tape_end ) tape_next = NULL;
+}
+
+/* Replies to frames go back the way the frames came */
+
+static inline void host_poll()
+{
+  host_replying = TRUE;
+  host_read();
+  host_replying = FALSE;
+}
+
+/* Process input from the host, called from the core0 loop.  Tape */
+/* goes into the reader ring as there is room.  Meanwhile the     */
+/* rest of the frame, and anything after it, waits in host_buf or */
+/* USB.  A coded record may be split between H_TAPE_RLE frames.   */
+/* Anything outside a frame is typed on the teleprinter keyboard. */
+/* A new frame is taken from bulk USB in preference to the serial */
+/* port, after which the frame is read to its end from the same.  */
+
+static inline void host_read()
+{
+  while ( TRUE )
+    {
+      uint32_t n;
+      if ( host_pos == host_len )
+	{
+	  if ( host_state == 0 )
+	    host_bulk = tud_vendor_n_available(USB_LINK) != 0;
+	  host_len = host_bulk
+	    ? tud_vendor_n_read(USB_LINK, host_buf, sizeof(host_buf))
+	    : tud_cdc_read(host_buf, sizeof(host_buf));
+	  host_pos = 0;
+	  if ( host_len == 0 ) return;
+	}
+      switch ( host_state )
+	{
+	case 0: // looking for start of frame
+	  if ( operator_type(host_buf[host_pos]) )
+	    ; // taken by the operator console
+	  else if ( host_buf[host_pos] == HOST_SYNC )
+	    host_state = 1;
+	  else if ( host_buf[host_pos] != UTF8_POUND
+		    || console_code == CODE_RAW )
+	    console_type(host_buf[host_pos]);
+	  host_pos++;
+	  break;
+	case 1:
+	  host_type = host_buf[host_pos++];
+	  host_state = 2;
+	  break;
+	case 2:
+	  host_left = host_buf[host_pos++];
+	  host_state = 3;
+	  break;
+	case 3:
+	  host_left |= host_buf[host_pos++] << 8;
+	  host_cmd_len = 0;
+	  host_state = 4;
+	  if ( host_left == 0 )
+	    {
+	      host_command();
+	      host_state = 0;
+	    }
+	  break;
+	default: // payload
+	  n = host_len - host_pos;
+	  if ( n > host_left ) n = host_left;
+	  if ( host_type == H_TAPE )
+	    host_chars += n = reader_fill(&host_buf[host_pos],
+					  MIN(n, reader_room()));
+	  else if ( host_type == H_TAPE_RLE )
+	    {
+	      const uint8_t *in = &host_buf[host_pos];
+	      host_chars += reader_decode(&host_rle, &in, in + n, UINT32_MAX);
+	      n = in - &host_buf[host_pos];
+	    }
+	  else if ( host_type == H_DATA )
+	    store_data(&host_buf[host_pos], n);
+	  else
+	    for ( uint32_t i = 0 ; i < n ; i++ )
+	      if ( host_cmd_len < HOST_CMD_MAX )
+		host_cmd[host_cmd_len++] = host_buf[host_pos + i];
+	  host_pos += n;
+	  if ( (host_left -= n) == 0 )
+	    {
+	      host_command();
+	      host_state = 0;
+	    }
+	  else if ( n == 0 )
+	    return; // reader ring full
+	}
+    }
+}
+
+/* Obey a frame once all of it has arrived */
+
+static void host_command()
+{
+  switch ( host_type )
+    {
+    case H_TAPE:
+    case H_TAPE_RLE:
+    case H_DATA:
+      break; // already dealt with
+    case H_STORE:
+      store_begin();
+      break;
+    case H_END:
+      store_end();
+      break;
+    case H_MOUNT:
+      if ( host_cmd_len == 0 )
+	puts("ERROR no tape number");
+      else
+	library_mount(host_cmd[0], host_cmd_len > 1 && host_cmd[1]);
+      break;
+    case H_UNMOUNT:
+      library_mount(LIBRARY_TAPES, host_cmd_len > 0 && host_cmd[0]);
+      break;
+    case H_SEEK:
+      if ( host_cmd_len < 2 )
+	puts("ERROR no block number");
+      else
+	library_seek(host_cmd[0] | (host_cmd[1] << 8));
+      break;
+    case H_LIST:
+      library_list();
+      break;
+    case H_PACE:
+      pace_command();
+      break;
+    case H_CONSOLE:
+      console_command();
+      break;
+    case H_CREDIT:
+      printf("OK credit %u taken %u\n", host_chars + reader_room(),
+	     host_chars);
+      break;
+    case H_TRACE:
+      trace_command();
+      break;
+    case H_BENCH:
+      bench_command();
+      break;
+#if PTS_LOOPBACK
+    case H_LOOP:
+      loop_command();
+      break;
+#endif
+    case H_ERRORS:
+      error_command();
+      break;
+    case H_CALIBRATE:
+      cal_command();
+      break;
+    case H_STATS:
+      if ( read_done.length ) sum_print(&read_done, "READ");
+      if ( punch_done.length ) sum_print(&punch_done, "PUNCHED");
+      printf("OK in %"PRIu64" out %"PRIu64" reader %u punch %u printer %u"
+	     " keyboard %u dropped %u unsent %u uncaptured %u\n",
+	     chars_total[DIR_IN], chars_total[DIR_OUT],
+	     ring_count(&reader_ring), ring_count(&punch_ring),
+	     ring_count(&printer_ring), ring_count(&keyboard_ring),
+	     events_dropped, punch_unsent, capture_lost);
+      break;
+    case H_LISTEN:
+      punch_bulk = host_cmd_len > 0 && host_cmd[0]
+	&& tud_vendor_n_mounted(USB_PUNCH);
+      punch_lease = time_us_32();
+      printf("OK punch to %s\n", punch_bulk ? "bulk" : "serial");
+      break;
+    case H_ERASE:
+      library_erase();
+      break;
+    case H_PUNCHED:
+      capture_list();
+      break;
+    case H_GET:
+      if ( host_cmd_len < 4 )
+	puts("ERROR no tape number");
+      else
+	capture_get(host_cmd[0] | (host_cmd[1] << 8) | (host_cmd[2] << 16)
+		    | (host_cmd[3] << 24));
+      break;
+    default:
+      printf("ERROR unknown frame type %u\n", host_type);
+    }
+}
+
+
+/* H_CONSOLE: CODE_RAW, CODE_5HOLE or CODE_8HOLE, both shifts */
+/* starting again as letters                                  */
+
+static void console_command()
+{
+  static const char *names[] = { "raw", "5 hole", "8 hole" };
+  if ( host_cmd_len == 0 || host_cmd[0] > CODE_8HOLE )
+    {
+      puts("ERROR no such code");
+      return;
+    }
+  console_code = host_cmd[0];
+  printer_shift = keyboard_shift = 0;
+  printf("OK console %s\n", names[console_code]);
+}
+
+/* H_TRACE: start recording, replay or stop either, or send the */
+/* trace, "OK entries" then the entries as recorded.  Replaying  */
+/* first takes away any tape being read, so that the trace is    */
+/* the only source of reader characters until it runs out.      */
+
+static void trace_command()
+{
+  uint32_t mode = host_cmd_len ? host_cmd[0] : TRACE_STOP;
+  switch ( mode )
+    {
+    case TRACE_STOP:
+      recording = replaying = FALSE;
+      break;
+    case TRACE_RECORD:
+      recording = replaying = FALSE;
+      trace_count = 0;
+      __dmb(); // before core1 adds to it
+      recording = TRUE;
+      break;
+    case TRACE_REPLAY:
+      recording = replaying = FALSE;
+      replay_pos = 0;
+      replay_started = FALSE;
+      __dmb(); // before core1 replays
+      replaying = TRUE;
+      mounted = LIBRARY_TAPES;
+      tape_start(NULL, NULL, TRUE); // drop staged character too
+      break;
+    case TRACE_GET:
+      recording = FALSE;
+      printf("OK %u\n", trace_count);
+      host_write((const uint8_t *) trace, trace_count * sizeof(trace_t));
+      return;
+    default:
+      puts("ERROR no such trace mode");
+      return;
+    }
+  printf("OK %u entries\n", trace_count);
+}
+
+/* H_CALIBRATE: margin (percent) starts calibrating, CAL_DEFAULTS */
+/* forgets the calibration from the next start up.  Either way,   */
+/* or with no payload, replies with the timing in use.            */
+
+static void cal_command()
+{
+  if ( host_cmd_len && (cal_started || store_active || !library_ok) )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  if ( host_cmd_len && host_cmd[0] == CAL_DEFAULTS )
+    {
+      if ( !flash_write(CONFIG_OFFSET, NULL, TRUE) )
+	{
+	  puts("ERROR busy");
+	  return;
+	}
+    }
+  else if ( host_cmd_len )
+    {
+      cal_result.margin = host_cmd[0];
+      cal_started = TRUE;
+      __dmb(); // margin before core1 starts
+      cal_pending = TRUE;
+    }
+  printf("OK ack %u nS timeout %u uS%s%s\n", ack_ns, poll_limit,
+	 config->magic == CONFIG_MAGIC ? " calibrated" : "",
+	 cal_started ? ", calibrating" : "");
+}
+
+/* Once core1 has finished calibrating keep the results in flash, */
+/* called from the core0 loop                                     */
+
+static inline void cal_poll()
+{
+  if ( !cal_started || cal_pending || store_active ) return;
+  memset(sector_buf, 0xFF, FLASH_SECTOR_SIZE);
+  memcpy(sector_buf, &cal_result, sizeof(cal_result));
+  if ( !flash_write(CONFIG_OFFSET, sector_buf, TRUE) ) return; // try again
+  cal_started = FALSE;
+  printf("CALIBRATED ack %u nS (shortest %u nS) timeout %u uS"
+	 " (longest release %u uS) margin %u%%\n", cal_result.ack_ns,
+	 cal_result.min_ack_ns, cal_result.timeout_us, cal_result.release_us,
+	 cal_result.margin);
+}
+
+/* H_ERRORS: ERR_... for the reader, punch and teleprinter, or one */
+/* for all three, then reply with the policies and error counts.   */
+/* With no payload only replies.                                   */
+
+static void error_command()
+{
+  for ( uint32_t i = 0 ; i < host_cmd_len && i < HIST_DEVICES ; i++ )
+    if ( host_cmd[i] > ERR_RESYNC )
+      {
+	puts("ERROR no such policy");
+	return;
+      }
+  for ( uint32_t d = 0 ; d < HIST_DEVICES ; d++ )
+    if ( host_cmd_len == 1 )
+      error_policy[d] = host_cmd[0];
+    else if ( d < host_cmd_len )
+      error_policy[d] = host_cmd[d];
+  printf("OK");
+  for ( uint32_t d = 0 ; d < HIST_DEVICES ; d++ )
+    printf(" %s %s", hist_names[d], err_names[error_policy[d]]);
+  printf(" timeouts %u retries %u skips %u resyncs %u watchdog %u\n",
+	 err_timeouts, err_retries, err_skips, err_resyncs,
+	 postmortem.resets);
+}
+
+/* H_BENCH: workload, pattern, transfers and optionally seed     */
+/* starts a benchmark, taking away any tape being read and        */
+/* stopping any trace.  With no payload reports the last results, */
+/* and with just BENCH_STOP ends the one running.                 */
+
+static void bench_command()
+{
+  if ( host_cmd_len == 0 )
+    {
+      if ( bench_started )
+	puts("ERROR benchmark running");
+      else if ( !bench_ran )
+	puts("ERROR no benchmark run");
+      else
+	bench_print("OK");
+      return;
+    }
+  if ( host_cmd_len == 1 && host_cmd[0] == BENCH_STOP )
+    {
+      if ( !bench_started )
+	puts("ERROR no benchmark running");
+      else
+	{
+	  bench_stop = TRUE; // results follow from bench_poll
+	  puts("OK stopping");
+	}
+      return;
+    }
+  if ( bench_started || mount_pending )
+    {
+      puts("ERROR busy");
+      return;
+    }
+  if ( host_cmd_len < 6 || host_cmd[0] > BENCH_TTYSEL
+       || host_cmd[1] > BENCH_ONES )
+    {
+      puts("ERROR no such benchmark");
+      return;
+    }
+  bench.workload = host_cmd[0];
+  bench.pattern = host_cmd[1];
+  bench.length = host_cmd[2] | (host_cmd[3] << 8) | (host_cmd[4] << 16)
+    | (host_cmd[5] << 24);
+  bench.seed = host_cmd_len < 10 ? BENCH_SEED : host_cmd[6]
+    | (host_cmd[7] << 8) | (host_cmd[8] << 16) | (host_cmd[9] << 24);
+  if ( bench.seed == 0 ) bench.seed = BENCH_SEED; // xorshift sticks at 0
+  recording = replaying = FALSE;
+  mounted = LIBRARY_TAPES;
+  tape_start(NULL, NULL, TRUE); // drop staged character too
+  bench_stop = FALSE;
+  __dmb(); // mount seen before benchmark
+  bench_pending = bench_started = TRUE;
+  __sev(); // wake core1 if idle
+#if PTS_LOOPBACK
+  loopback_start(&bench, host_cmd_len < 14 ? 0 : host_cmd[10]
+		 | (host_cmd[11] << 8) | (host_cmd[12] << 16)
+		 | (host_cmd[13] << 24));
+#endif
+  printf("OK benchmark %s %s %u seed %u\n", bench_workloads[bench.workload],
+	 bench_patterns[bench.pattern], bench.length, bench.seed);
+}
+
+/* Print the results once core1 has finished, called from the */
+/* core0 loop                                                 */
+
+static inline void bench_poll()
+{
+  if ( !bench_started || bench_pending ) return;
+#if PTS_LOOPBACK
+  loopback_poll(); // check the last characters read
+  loop_active = FALSE;
+#endif
+  bench_started = FALSE;
+  bench_ran = TRUE;
+  bench_print("BENCH");
+}
+
+/* Results as name=value pairs: throughput, then each latency as */
+/* 50th, 90th, 99th and 99.9th percentiles and maximum (uS)       */
+
+static void bench_print(const char *prefix)
+{
+  static const char *kinds[2] = { "req_ack", "ack_clear" };
+  static const char *ends[3] = { "done", "stalled", "stopped" };
+  const bench_result_t *res = &bench_result;
+  uint32_t cps = res->elapsed ?
+    (uint64_t) res->transfers * 1000000 / res->elapsed : 0;
+  printf("%s workload=%s pattern=%s length=%u seed=%u transfers=%u"
+	 " errors=%u timeouts=%u ended=%s elapsed_us=%u cps=%u", prefix,
+	 bench_workloads[bench.workload], bench_patterns[bench.pattern],
+	 bench.length, bench.seed, res->transfers, res->errors,
+	 res->timeouts, ends[res->ended], res->elapsed, cps);
+  for ( uint32_t k = HIST_REQ_ACK ; k <= HIST_ACK_CLEAR ; k++ )
+    printf(" %s_p50=%u %s_p90=%u %s_p99=%u %s_p999=%u %s_max=%u",
+	   kinds[k], bench_percentile(res->lat[k], res->transfers, 500),
+	   kinds[k], bench_percentile(res->lat[k], res->transfers, 900),
+	   kinds[k], bench_percentile(res->lat[k], res->transfers, 990),
+	   kinds[k], bench_percentile(res->lat[k], res->transfers, 999),
+	   kinds[k], res->max[k]);
+#if PTS_LOOPBACK
+  printf(" loop_errors=%u", loop_errors);
+#endif
+  putchar('\n');
+}
+
+/* Smallest latency (uS) no less than permille/1000 of the n counted */
+
+static uint32_t bench_percentile(const uint32_t *lat, uint32_t n,
+				 uint32_t permille)
+{
+  uint64_t want = ((uint64_t) n * permille + 999) / 1000, seen = 0;
+  for ( uint32_t us = 0 ; us < BENCH_LAT_MAX ; us++ )
+    if ( (seen += lat[us]) >= want && want ) return us;
+  return 0;
+}
+
+/* H_PACE: pacing on (non zero) or off, then optionally the      */
+/* characters per second, or 0 for no pacing, of the reader,     */
+/* punch and teleprinter.  Takes effect from the next transfer,  */
+/* except that a tape already streaming by DMA runs on unpaced.  */
+
+static void pace_command()
+{
+  if ( host_cmd_len == 0 )
+    {
+      puts("ERROR no pacing mode");
+      return;
+    }
+  for ( uint32_t d = 0 ; d < HIST_DEVICES && host_cmd_len >= 3 + 2 * d ; d++ )
+    {
+      uint32_t cps = host_cmd[1 + 2 * d] | (host_cmd[2 + 2 * d] << 8);
+      pace_period[d] = cps ? 1000000 / cps : 0;
+    }
+  pacing = host_cmd[0] != 0;
+  printf("OK %s", pacing ? "paced" : "unpaced");
+  for ( uint32_t d = 0 ; d < HIST_DEVICES ; d++ )
+    printf(" %s %u uS", hist_names[d], pace_period[d]);
+  putchar('\n');
+}
+
+/* Send punch output to the host and capture it in flash.        */
+/* Characters are only taken from the ring in batches of at least */
+/* PUNCH_PACKET, or whatever is left once the punch has been idle */
+/* for PUNCH_IDLE_US, so that USB packets are full.  With no host */
+/* attached they are only captured, and once the host has taken   */
+/* nothing for USB_WRITE_US the bulk interface is given up for    */
+/* the serial port and the serial port for capture alone, unless  */
+/* there is no capture, when the punch waits.  Called from the    */
+/* core0 loop.                                                    */
+
+static inline void usb_punch_poll()
+{
+  static uint32_t last_count = 0, last_time = 0, stuck = FALSE, stuck_time;
+  uint8_t buf[PUNCH_PACKET];
+  uint32_t n, idle, count = ring_count(&punch_ring), now = time_us_32();
+  uint32_t to_bulk, to_host;
+  if ( punch_bulk && ( !tud_vendor_n_mounted(USB_PUNCH)
+		       || now - punch_lease > PUNCH_LEASE_US ) )
+    punch_bulk = FALSE; // gone away or stopped renewing
+  to_bulk = punch_bulk;
+  to_host = to_bulk || tud_cdc_connected() || !capture_ok;
+  if ( !to_host ) stuck = FALSE;
+  if ( count != last_count )
+    {
+      last_count = count;
+      last_time = now; // punch still active
+    }
+  idle = now - last_time >= PUNCH_IDLE_US;
+  while ( (count = ring_count(&punch_ring)) )
+    {
+      if ( count < PUNCH_PACKET && !idle ) break; // wait for a full packet
+      n = sizeof(buf);
+      if ( to_host )
+	{
+	  n = to_bulk ? tud_vendor_n_write_available(USB_PUNCH)
+	    : tud_cdc_write_available();
+	  if ( n > sizeof(buf) ) n = sizeof(buf);
+	  if ( n >= count || n >= PUNCH_PACKET )
+	    stuck = FALSE;
+	  else if ( !stuck )
+	    {
+	      stuck = TRUE;
+	      stuck_time = now;
+	      break; // wait for USB
+	    }
+	  else if ( !capture_ok || now - stuck_time < USB_WRITE_US )
+	    break; // wait for USB
+	  else if ( to_bulk )
+	    {
+	      punch_bulk = stuck = FALSE; // host tool not listening
+	      break; // serial port from the next poll
+	    }
+	  else
+	    {
+	      to_host = FALSE; // capture alone until the host takes some
+	      n = sizeof(buf);
+	    }
+	}
+      if ( capture_ok && !to_host && (n = MIN(n, capture_room())) == 0 )
+	break; // wait for flash
+      n = ring_read(&punch_ring, buf, n);
+      sum_add(&punch_sum, buf, n);
+      if ( capture_ok && to_host )
+	capture_spare(buf, n); // host not kept waiting for flash
+      else if ( capture_ok )
+	capture_add(buf, n);
+      if ( stuck && !to_host ) punch_unsent += n;
+      if ( to_bulk )
+	tud_vendor_n_write(USB_PUNCH, buf, n); // sent as it arrives
+      else if ( to_host )
+	tud_cdc_write(buf, n);
+    }
+  tud_cdc_write_flush();
+  last_count = ring_count(&punch_ring);
+}
+
+/* Send teleprinter output to the host straight away, a little at */
+/* a time and translated to ASCII, so it is not held up behind    */
+/* punch output.  With no host it is thrown away so the computer  */
+/* is not stopped.                                                */
+
+static inline void console_poll()
+{
+  uint8_t buf[32], out[2 * sizeof(buf)];
+  uint32_t n = ring_count(&printer_ring);
+  if ( n == 0 ) return;
+  if ( tud_cdc_connected() )
+    {
+      n = MIN(MIN(n, tud_cdc_write_available() / 2), sizeof(buf));
+      if ( n == 0 ) return; // wait for USB
+      n = ring_read(&printer_ring, buf, n);
+      tud_cdc_write(out, console_translate(buf, n, out));
+      tud_cdc_write_flush();
+    }
+  else
+    printer_ring.tail = printer_ring.head;
+}
+
+/* Send to the host, the way the frame being obeyed came */
+
+static void host_write(const uint8_t *s, uint32_t n)
+{
+  usb_write(host_bulk, s, n);
+}
+
+/* stdio output, which is a reply if obeying a frame */
+
+static void console_out_chars(const char *s, int n)
+{
+  usb_write(host_replying && host_bulk, (const uint8_t *) s, n);
+}
+
+/* Send on the link interface or the serial port, waiting for room */
+/* while the host is there and taking something, and feeding the   */
+/* watchdog meanwhile                                              */
+
+static void usb_write(uint32_t bulk, const uint8_t *s, uint32_t n)
+{
+  uint32_t start = time_us_32();
+  while ( n && ( bulk ? tud_vendor_n_mounted(USB_LINK) : tud_cdc_connected() )
+	  && time_us_32() - start < USB_WRITE_US )
+    {
+      uint32_t m = bulk ? tud_vendor_n_write(USB_LINK, s, n)
+	: tud_cdc_write(s, n);
+      if ( !bulk ) tud_cdc_write_flush();
+      if ( m ) start = time_us_32();
+      s += m;
+      n -= m;
+      if ( n ) tud_task(); // let USB make room
+      watchdog_poll();
+    }
+}
+
+/* Sleep, keeping USB going and the watchdog fed */
+
+static void usb_sleep_ms(uint32_t ms)
+{
+  absolute_time_t until = make_timeout_time_ms(ms);
+  while ( !time_reached(until) )
+    {
+      tud_task();
+      watchdog_poll();
+    }
+}
+
+
+
+/**********************************************************/
+/*                    OPERATOR CONSOLE                    */
+/**********************************************************/
+
+
+/* Serial port input outside a frame, returns TRUE if it is for */
+/* the operator console rather than the teleprinter keyboard.   */
+/* Only a line at a time is taken, so the command is obeyed in  */
+/* full once return is typed.                                   */
+
+static uint32_t operator_type(uint32_t ch)
+{
+  uint32_t state = operator_state;
+  if ( host_bulk ) return FALSE;
+  if ( state != OP_TYPING )
+    {
+      operator_state = OP_IDLE;
+      if ( state == OP_DONE && ch == '\n' ) return TRUE; // rest of CR LF
+      if ( ch != OPERATOR_ESCAPE || console_code == CODE_RAW ) return FALSE;
+      operator_state = OP_TYPING;
+      operator_len = 0;
+      printf("\npts> ");
+      return TRUE;
+    }
+  if ( ch == '\r' || ch == '\n' )
+    {
+      putchar('\n');
+      operator_state = ch == '\r' ? OP_DONE : OP_IDLE;
+      operator_line[operator_len] = '\0';
+      operator_command(operator_line);
+    }
+  else if ( ch == OPERATOR_ESCAPE || ch == 033 || ch == 003 )
+    {
+      puts(" - cancelled");
+      operator_state = OP_IDLE;
+    }
+  else if ( ch == '\b' || ch == 0177 )
+    {
+      if ( operator_len == 0 ) return TRUE;
+      operator_len--;
+      printf("\b \b");
+    }
+  else if ( ch >= ' ' && ch < 0177 && operator_len < OPERATOR_MAX - 1 )
+    {
+      operator_line[operator_len++] = ch;
+      putchar(ch);
+    }
+  return TRUE;
+}
+
+/* Obey a command line: words are split off and turned into the  */
+/* payload of the host frame the command stands for, which is    */
+/* then obeyed as if the host had sent it, replying on the serial */
+/* port, unless the command is one of the console's own.         */
+
+static void operator_command(char *line)
+{
+  char *word[OPERATOR_WORDS];
+  uint32_t n = 0, value;
+  const operator_t *op;
+  for ( char *p = strtok(line, " \t") ; p && n < OPERATOR_WORDS ;
+	p = strtok(NULL, " \t") )
+    word[n++] = p;
+  if ( n == 0 ) return;
+  for ( op = operators ; op->name && strcmp(op->name, word[0]) ; op++ ) ;
+  if ( op->name == NULL )
+    {
+      printf("ERROR no such command %s, try help\n", word[0]);
+      return;
+    }
+  if ( n - 1 > strlen(op->args) )
+    {
+      puts("ERROR too many arguments");
+      return;
+    }
+  host_cmd_len = 0;
+  for ( uint32_t i = 1 ; i < n ; i++ )
+    {
+      if ( !operator_value(word[i], &value) )
+	{
+	  printf("ERROR bad argument %s\n", word[i]);
+	  return;
+	}
+      for ( uint32_t b = 0 ; b < op->args[i - 1] ; b++ )
+	host_cmd[host_cmd_len++] = value >> 8 * b;
+    }
+  switch ( op->type )
+    {
+    case OP_HELP:
+      operator_help();
+      break;
+    case OP_RESET:
+      counts_reset = TRUE;
+      __sev(); // core1 may be sleeping
+      for ( uint32_t dir = DIR_IN ; dir <= DIR_OUT ; dir++ )
+	{
+	  chars_total[dir] = 0;
+	  for ( uint32_t s = 0 ; s < RATE_HISTORY ; s++ )
+	    chars_history[dir][s] = 0;
+	}
+      puts("OK counts reset");
+      break;
+    case OP_HIST:
+      print_histograms();
+      break;
+    case OP_DUMP:
+      dump_pos = 0;
+      dump_end = trace_count;
+      printf("OK trace %u entries\n", dump_end);
+      break;
+    case OP_LOG:
+      value = host_cmd_len ? host_cmd[0] : !logging_enabled;
+      logging_enabled = value != FALSE;
+      log_transfers = value == LOG_ALL;
+      printf("OK logging %s\n", log_transfers ? "all"
+	     : logging_enabled ? "on" : "off");
+      break;
+    default:
+      host_type = op->type;
+      host_command();
+    }
+}
+
+/* Value of a command argument: a number, one of operator_words */
+/* or an error policy.  Returns FALSE if it is none of them.     */
+
+static uint32_t operator_value(const char *word, uint32_t *value)
+{
+  char *end;
+  *value = strtoul(word, &end, 0);
+  if ( end != word && *end == '\0' ) return TRUE;
+  for ( uint32_t i = 0 ; operator_words[i] ; i++ )
+    if ( strcmp(word, operator_words[i]) == 0 )
+      {
+	*value = operator_values[i];
+	return TRUE;
+      }
+  for ( uint32_t i = 0 ; i < count_of(err_names) ; i++ )
+    if ( strcmp(word, err_names[i]) == 0 )
+      {
+	*value = i;
+	return TRUE;
+      }
+  return FALSE;
+}
+
+static void operator_help()
+{
+  printf("Type control-] then a command and return:\n");
+  for ( const operator_t *op = operators ; op->name ; op++ )
+    printf("  %-8s %-18s %s\n", op->name, op->usage, op->help);
+}
+
+/* Called from the core0 loop: print a few more lines of any trace */
+/* being dumped, as there is room, and follow LOG_PIN if it moves.  */
+
+static inline void operator_poll()
+{
+  if ( logging() != log_pin )
+    {
+      log_pin = !log_pin;
+      logging_enabled = log_pin;
+    }
+  if ( dump_pos == dump_end ) return;
+  if ( !tud_cdc_connected() )
+    {
+      dump_pos = dump_end; // nobody to print to
+      return;
+    }
+  for ( uint32_t i = 0 ; i < OPERATOR_BATCH && dump_pos < dump_end ; i++ )
+    {
+      trace_t *t = &trace[dump_pos];
+      if ( tud_cdc_write_available() < 64 ) return; // wait for USB
+      printf("TRACE %4u %10u %-6s %03o req-ack %u ack-clear %u\n",
+	     dump_pos++, t->time, hist_names[t->device], t->ch, t->req_ack,
+	     t->ack_clear);
     }
 }
 
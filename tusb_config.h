@@ -0,0 +1,34 @@
+// Elliott 900 Paper Tape Station emulator for Raspberry Pi Pico
+
+// Copyright (c) Andrew Herbert - 26/06/2021
+
+// MIT Licence.
+
+// TinyUSB configuration.  A CDC serial port carries the console and
+// logging.  Two vendor class bulk interfaces carry tape: host link
+// frames and their replies on one and punch output on the other
+// (see usb_descriptors.c).
+
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+#ifndef CFG_TUSB_RHPORT0_MODE
+#define CFG_TUSB_RHPORT0_MODE    OPT_MODE_DEVICE
+#endif
+
+#define CFG_TUD_ENDPOINT0_SIZE   64
+
+#define CFG_TUD_CDC              1
+#define CFG_TUD_MSC              0
+#define CFG_TUD_HID              0
+#define CFG_TUD_MIDI             0
+#define CFG_TUD_VENDOR           2
+
+#define CFG_TUD_CDC_RX_BUFSIZE   256
+#define CFG_TUD_CDC_TX_BUFSIZE   256
+
+#define CFG_TUD_VENDOR_EPSIZE    64 // full speed bulk packet
+#define CFG_TUD_VENDOR_RX_BUFSIZE 512
+#define CFG_TUD_VENDOR_TX_BUFSIZE 512
+
+#endif
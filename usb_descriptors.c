@@ -0,0 +1,129 @@
+// Elliott 900 Paper Tape Station emulator for Raspberry Pi Pico
+
+// Copyright (c) Andrew Herbert - 26/06/2021
+
+// MIT Licence.
+
+// USB descriptors: a CDC serial port for the console and logging,
+// then two vendor class interfaces each with a pair of bulk
+// endpoints.  The first carries host link frames to the station and
+// replies back, the second punch output.  Host tools find them by
+// class 0xFF and interface number (ITF_LINK, ITF_PUNCH).
+
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "pico/unique_id.h"
+
+#define USB_VID 0x2E8A // Raspberry Pi
+#define USB_PID 0x000A // Pico SDK CDC, as before
+#define USB_BCD 0x0200
+
+enum
+  {
+    ITF_CDC = 0, // uses two interfaces
+    ITF_CDC_DATA,
+    ITF_LINK,
+    ITF_PUNCH,
+    ITF_COUNT
+  };
+
+#define EP_CDC_NOTIF 0x81
+#define EP_CDC_OUT   0x02
+#define EP_CDC_IN    0x82
+#define EP_LINK_OUT  0x03
+#define EP_LINK_IN   0x83
+#define EP_PUNCH_OUT 0x04
+#define EP_PUNCH_IN  0x84
+
+#define STR_MANUFACTURER 1
+#define STR_PRODUCT      2
+#define STR_SERIAL       3
+#define STR_CDC          4
+#define STR_LINK         5
+#define STR_PUNCH        6
+
+#define CONFIG_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN \
+		    + 2 * TUD_VENDOR_DESC_LEN)
+
+static const tusb_desc_device_t device_descriptor =
+  {
+    .bLength            = sizeof(tusb_desc_device_t),
+    .bDescriptorType    = TUSB_DESC_DEVICE,
+    .bcdUSB             = USB_BCD,
+    .bDeviceClass       = TUSB_CLASS_MISC, // CDC needs IAD
+    .bDeviceSubClass    = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol    = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
+    .idVendor           = USB_VID,
+    .idProduct          = USB_PID,
+    .bcdDevice          = 0x0100,
+    .iManufacturer      = STR_MANUFACTURER,
+    .iProduct           = STR_PRODUCT,
+    .iSerialNumber      = STR_SERIAL,
+    .bNumConfigurations = 1
+  };
+
+static const uint8_t config_descriptor[] =
+  {
+    TUD_CONFIG_DESCRIPTOR(1, ITF_COUNT, 0, CONFIG_LEN, 0, 250),
+    TUD_CDC_DESCRIPTOR(ITF_CDC, STR_CDC, EP_CDC_NOTIF, 8,
+		       EP_CDC_OUT, EP_CDC_IN, 64),
+    TUD_VENDOR_DESCRIPTOR(ITF_LINK, STR_LINK, EP_LINK_OUT, EP_LINK_IN, 64),
+    TUD_VENDOR_DESCRIPTOR(ITF_PUNCH, STR_PUNCH, EP_PUNCH_OUT, EP_PUNCH_IN,
+			  64)
+  };
+
+static const char *strings[] =
+  {
+    NULL, // language, sent as 0x0409
+    "Andrew Herbert",
+    "PicoPTS Elliott 900 Paper Tape Station",
+    NULL, // serial number, from the flash's unique id
+    "PicoPTS console",
+    "PicoPTS host link",
+    "PicoPTS punch"
+  };
+
+const uint8_t *tud_descriptor_device_cb(void)
+{
+  return (const uint8_t *) &device_descriptor;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
+{
+  (void) index;
+  return config_descriptor;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+  static uint16_t desc[40]; // UTF-16, first word is type and length
+  char serial[2 * sizeof(pico_unique_board_id_t) + 1];
+  const char *s;
+  uint32_t n;
+  (void) langid;
+  if ( index == 0 )
+    {
+      desc[1] = 0x0409; // English
+      n = 1;
+    }
+  else
+    {
+      if ( index >= sizeof(strings) / sizeof(strings[0]) ) return NULL;
+      if ( index == STR_SERIAL )
+	{
+	  pico_unique_board_id_t id;
+	  pico_get_unique_board_id(&id);
+	  for ( n = 0 ; n < sizeof(id.id) ; n++ )
+	    sprintf(&serial[2 * n], "%02X", id.id[n]);
+	  s = serial;
+	}
+      else
+	s = strings[index];
+      for ( n = 0 ; s[n] && n < sizeof(desc) / 2 - 1 ; n++ )
+	desc[1 + n] = s[n];
+    }
+  desc[0] = (TUSB_DESC_STRING << 8) | (2 * n + 2);
+  return desc;
+}